@@ -0,0 +1,109 @@
+#include "codegen.h"
+#include "common.h"
+#include "parser.h"
+#include "stats.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Target/TargetMachine.h"
+
+static cl::opt<bool>
+    linkExecutable("exe",
+                   cl::desc("Link the compiled object with the runtime into "
+                            "an executable"),
+                   cl::init(false));
+
+static cl::opt<std::string>
+    runtimeLib("runtime",
+               cl::desc("Runtime library to link executables against "
+                        "(default: libkalrt.a next to this program)"),
+               cl::value_desc("path"), cl::init(""));
+
+// Emit `int main()` running every top-level expression in source order.
+static void emitMain(const std::vector<Function *> &topLevel) {
+  FunctionType *ft = FunctionType::get(Builder->getInt32Ty(), false);
+  Function *mainFunc =
+      Function::Create(ft, Function::ExternalLinkage, "main", theModule.get());
+  Builder->SetInsertPoint(BasicBlock::Create(*theContext, "entry", mainFunc));
+  for (Function *f : topLevel) {
+    f->setLinkage(Function::InternalLinkage);
+    Builder->CreateCall(f);
+  }
+  Builder->CreateRet(Builder->getInt32(0));
+  verifyFunction(*mainFunc);
+}
+
+static std::string getRuntimeLib() {
+  if (!runtimeLib.empty())
+    return runtimeLib;
+  std::string self = sys::fs::getMainExecutable(nullptr, nullptr);
+  SmallString<128> path(sys::path::parent_path(self));
+  sys::path::append(path, "libkalrt.a");
+  return std::string(path.str());
+}
+
+static int linkObject(StringRef objFile, StringRef exeFile) {
+  auto cc = sys::findProgramByName("cc");
+  if (!cc) {
+    errs() << "cannot find a C compiler to link with: "
+           << cc.getError().message() << "\n";
+    return 1;
+  }
+  std::string rt = getRuntimeLib();
+  // scripts call libm externs (and LLVM may lower intrinsics to libm calls);
+  // the runtime's parfor thread pool needs -pthread
+  SmallVector<StringRef, 8> args = {*cc, objFile, rt, "-lm", "-pthread",
+                                    "-o", exeFile};
+  std::string errMsg;
+  if (sys::ExecuteAndWait(*cc, args, std::nullopt, {}, 0, 0, &errMsg)) {
+    errs() << "linking " << exeFile << " failed";
+    if (!errMsg.empty())
+      errs() << ": " << errMsg;
+    errs() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+int compileAOT(const std::string &outFile) {
+  TargetMachine &TM = initAOTTarget();
+  initModuleAndPassMgr();
+
+  emitMain(codegenAll());
+  optimizeModule();
+
+  std::string objFile = linkExecutable ? outFile + ".o" : outFile;
+  std::error_code ec;
+  raw_fd_ostream dest(objFile, ec, sys::fs::OF_None);
+  if (ec) {
+    errs() << "cannot open " << objFile << ": " << ec.message() << "\n";
+    return 1;
+  }
+
+  legacy::PassManager pass;
+  if (TM.addPassesToEmitFile(pass, dest, nullptr, CGFT_ObjectFile)) {
+    errs() << "target cannot emit object files\n";
+    return 1;
+  }
+  {
+    PhaseTimer timer(Phase::compile);
+    pass.run(*theModule);
+  }
+  stats::counters.modules++;
+  stats::counters.objectBytes += dest.tell();
+  dest.close();
+
+  if (!linkExecutable)
+    return 0;
+  int ret = linkObject(objFile, outFile);
+  sys::fs::remove(objFile);
+  return ret;
+}
@@ -0,0 +1,72 @@
+#include "common.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+static cl::list<std::string> arrayFiles(
+    "array",
+    cl::desc("Bind `extern name[]` to the raw doubles in <file>, mapped "
+             "into memory without copying (writes stay private)"),
+    cl::value_desc("name=file"));
+
+static ExitOnError exitOnError;
+
+void bindArray(const std::string &name, KalArray *array) {
+  exitOnError(theJIT->defineAbsolute(name, array));
+}
+
+// descriptors and mappings of the -array files, alive until exit
+static std::deque<KalArray> fileArrays;
+static std::deque<sys::fs::mapped_file_region> fileMappings;
+
+static bool bindArrayFile(StringRef name, StringRef path) {
+  auto fail = [&](const std::string &why) {
+    errs() << "cannot map " << path << ": " << why << "\n";
+    return false;
+  };
+  uint64_t size;
+  if (auto ec = sys::fs::file_size(path, size))
+    return fail(ec.message());
+  if (size % sizeof(double))
+    return fail("size is not a multiple of 8 bytes");
+
+  KalArray &array = fileArrays.emplace_back();
+  array.data = nullptr;
+  array.length = size / sizeof(double);
+  if (size) {
+    auto fd = sys::fs::openNativeFileForRead(path);
+    if (!fd)
+      return fail(toString(fd.takeError()));
+    // copy-on-write: the script may store to the array, the file stays as is
+    std::error_code ec;
+    auto &region = fileMappings.emplace_back(
+        *fd, sys::fs::mapped_file_region::priv, size, 0, ec);
+    sys::fs::closeFile(*fd);
+    if (ec)
+      return fail(ec.message());
+    array.data = reinterpret_cast<double *>(region.data());
+  }
+  bindArray(name.str(), &array);
+  LogInfo("array %s: %lld elements from %s\n", name.str().c_str(),
+          (long long)array.length, path.str().c_str());
+  return true;
+}
+
+bool bindArrayFiles() {
+  for (const std::string &spec : arrayFiles) {
+    auto [name, path] = StringRef(spec).split('=');
+    if (name.empty() || path.empty()) {
+      errs() << "-array expects name=file, not " << spec << "\n";
+      return false;
+    }
+    if (!bindArrayFile(name, path))
+      return false;
+  }
+  return true;
+}
@@ -1,17 +1,166 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/Allocator.h"
 
 using namespace llvm;
 
+// Identifiers are interned once by the parser; the AST refers to them by ID.
+using SymbolID = unsigned;
+
+class SymbolTable {
+  StringMap<SymbolID> ids;
+  std::vector<StringRef> names; // keys owned by ids
+
+  // For -serve, whose sessions give their names back when they end: how many
+  // recording sets hold each name, or permanent. Names interned while
+  // nothing records are permanent, and so are those the compiler keeps.
+  static constexpr unsigned permanent = ~0u;
+  std::vector<unsigned> holders;
+  std::vector<SymbolID> freeIDs; // of released names, for reuse
+  DenseSet<SymbolID> *recording = nullptr;
+
+public:
+  SymbolID intern(StringRef name) {
+    auto [it, added] = ids.try_emplace(name, (SymbolID)names.size());
+    if (added) {
+      if (freeIDs.empty()) {
+        names.push_back(it->getKey());
+        holders.push_back(0);
+      } else {
+        it->second = freeIDs.back();
+        freeIDs.pop_back();
+        names[it->second] = it->getKey();
+      }
+    }
+    SymbolID id = it->second;
+    if (!recording)
+      holders[id] = permanent;
+    else if (recording->insert(id).second && holders[id] != permanent)
+      holders[id]++;
+    return id;
+  }
+  // Intern a name whose ID the compiler keeps for good.
+  SymbolID internPermanent(StringRef name) {
+    SymbolID id = intern(name);
+    holders[id] = permanent;
+    return id;
+  }
+  StringRef getName(SymbolID id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+
+  // Add every name interned from now on to set, or stop if it is null.
+  void record(DenseSet<SymbolID> *set) { recording = set; }
+  // Give back the names of set, which recorded them. Those no other set
+  // holds are forgotten and their IDs reused, so nothing may refer to them.
+  void release(const DenseSet<SymbolID> &set) {
+    for (SymbolID id : set) {
+      if (holders[id] == permanent || --holders[id])
+        continue;
+      ids.erase(names[id]);
+      names[id] = StringRef();
+      freeIDs.push_back(id);
+    }
+  }
+};
+
+extern SymbolTable symbols;
+
+// Table indexed directly by SymbolID; entries never set read as T().
+template <typename T> class SymbolMap {
+  std::vector<T> items;
+
+public:
+  T lookup(SymbolID id) const { return id < items.size() ? items[id] : T(); }
+  T &operator[](SymbolID id) {
+    if (id >= items.size())
+      items.resize(std::max<size_t>(id + 1, symbols.size()));
+    return items[id];
+  }
+};
+
+// Bump allocator for AST nodes. Nodes are never destroyed one by one: the
+// whole arena is released with reset(), so node classes must not own memory
+// (no std::string, std::vector or unique_ptr members). Lists are copied into
+// the arena and referenced through ArrayRef.
+class ASTArena {
+  BumpPtrAllocator alloc;
+
+public:
+  // totals over all arenas since startup, for -time
+  static inline size_t totalNodes = 0, totalBytes = 0;
+
+  template <typename T, typename... Args> T *make(Args &&...args) {
+    totalNodes++;
+    totalBytes += sizeof(T);
+    return new (alloc.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  template <typename T> ArrayRef<T> copy(ArrayRef<T> items) {
+    if (items.empty())
+      return {};
+    totalBytes += items.size() * sizeof(T);
+    T *mem = alloc.Allocate<T>(items.size());
+    std::uninitialized_copy(items.begin(), items.end(), mem);
+    return ArrayRef<T>(mem, items.size());
+  }
+
+  void reset() { alloc.Reset(); }
+};
+
+// Definitions and prototypes live as long as the program, or a session's as
+// long as the session (see server.cpp); top-level expressions are freed as
+// soon as they have been compiled.
+extern ASTArena defArena, exprArena;
+
+// Variables of one function activation in the tier-0 interpreter; see tier.cpp.
+class InterpFrame;
+// Bytecode compiler state for one function; see bytecode.h.
+class BytecodeBuilder;
+// Variables of a vector variant being emitted; see simd.cpp.
+class SimdScope;
+
 class ExprAST {
 public:
-  virtual ~ExprAST() {}
   virtual Value *codegen() = 0;
+  // Interpret the expression (tier 0 of -tiered execution).
+  virtual double eval(InterpFrame &frame) const = 0;
+  // Compile the expression to bytecode that leaves its value in register dst.
+  virtual void emitBytecode(BytecodeBuilder &b, unsigned dst) const = 0;
+  // Compile the expression and return the register holding its value: a
+  // fresh temporary, or a variable's own register.
+  virtual unsigned emitBytecodeOperand(BytecodeBuilder &b) const;
+  // The value the expression's code would compute, if it is a constant made
+  // of literals and built-in operators only; see fold.cpp.
+  virtual std::optional<double> fold() const { return std::nullopt; }
+  // Call fn for every call in the expression, user-defined operators
+  // included (for the purity analysis in memo.cpp).
+  virtual void forEachCallee(function_ref<void(SymbolID)> fn) const = 0;
+  // Whether the expression may assign to the variable var.
+  virtual bool assigns(SymbolID var) const = 0;
+  // The variable the expression names, if it is a plain variable reference.
+  virtual std::optional<SymbolID> getVariable() const { return std::nullopt; }
+  // Emit the expression as an i64 array index if its value is known to be an
+  // exact integer (a literal, a counted loop's variable, or sums and
+  // differences of those); otherwise emit nothing and return null.
+  virtual Value *codegenIndex() { return nullptr; }
+  // Emit the expression for every lane of a vector variant at once, as
+  // straight-line vector code (see simd.h); null if it has no such form.
+  virtual Value *codegenSimd(SimdScope &scope) const { return nullptr; }
 };
 
 class NumberExprAST : public ExprAST {
@@ -20,122 +169,335 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double val) : val(val) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override { return false; }
+  Value *codegenIndex() override;
+  std::optional<double> fold() const override { return val; }
 };
 
 class VariableExprAST : public ExprAST {
-  std::string name;
+  SymbolID name;
 
 public:
-  VariableExprAST(std::string_view name) : name(name) {}
+  VariableExprAST(SymbolID name) : name(name) {}
   Value *codegen() override;
-  const std::string getName() const { return name; }
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override { return false; }
+  std::optional<SymbolID> getVariable() const override { return name; }
+  Value *codegenIndex() override;
+  unsigned emitBytecodeOperand(BytecodeBuilder &b) const override;
+  SymbolID getName() const { return name; }
 };
 
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
-  std::unique_ptr<ExprAST> body;
+  ArrayRef<std::pair<SymbolID, ExprAST *>> varNames;
+  ExprAST *body;
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : varNames(std::move(VarNames)), body(std::move(Body)) {}
+  VarExprAST(ArrayRef<std::pair<SymbolID, ExprAST *>> varNames, ExprAST *body)
+      : varNames(varNames), body(body) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
 };
 
 class BinaryExprAST : public ExprAST {
   char op;
-  std::unique_ptr<ExprAST> lhs, rhs;
+  ExprAST *lhs, *rhs;
 
 public:
-  BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs,
-                std::unique_ptr<ExprAST> rhs)
-      : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
+      : op(op), lhs(lhs), rhs(rhs) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
+  Value *codegenIndex() override;
+  std::optional<double> fold() const override;
 };
 
 class UnaryExprAST : public ExprAST {
   char op;
-  std::unique_ptr<ExprAST> operand;
+  ExprAST *operand;
 
 public:
-  UnaryExprAST(char op, std::unique_ptr<ExprAST> operand)
-      : op(op), operand(std::move(operand)) {}
+  UnaryExprAST(char op, ExprAST *operand) : op(op), operand(operand) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
 };
 
 class CallExprAST : public ExprAST {
-  std::string callee;
-  std::vector<std::unique_ptr<ExprAST>> args;
+  SymbolID callee;
+  ArrayRef<ExprAST *> args;
 
 public:
-  CallExprAST(std::string_view callee,
-              std::vector<std::unique_ptr<ExprAST>> args)
-      : callee(callee), args(std::move(args)) {}
+  CallExprAST(SymbolID callee, ArrayRef<ExprAST *> args)
+      : callee(callee), args(args) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
 };
 
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> cond, then_, else_;
+  ExprAST *cond, *then_, *else_;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then_,
-            std::unique_ptr<ExprAST> else_)
-      : cond(std::move(cond)), then_(std::move(then_)),
-        else_(std::move(else_)) {}
+  IfExprAST(ExprAST *cond, ExprAST *then_, ExprAST *else_)
+      : cond(cond), then_(then_), else_(else_) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  Value *codegenSimd(SimdScope &scope) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
+  std::optional<double> fold() const override;
 };
 
 class ForExprAST : public ExprAST {
-  std::string varName;
-  std::unique_ptr<ExprAST> start, end, step, body;
+  SymbolID varName;
+  ExprAST *start, *end, *step, *body;
+  // y if the end condition is `varName < y`, for counting with an integer
+  ExprAST *bound;
+
+  Value *codegenCounted(double startVal, double stepVal);
+
+public:
+  ForExprAST(SymbolID varName, ExprAST *start, ExprAST *end, ExprAST *step,
+             ExprAST *body, ExprAST *bound = nullptr)
+      : varName(varName), start(start), end(end), step(step), body(body),
+        bound(bound) {}
+  Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
+};
+
+// parfor var = start, var < bound [, step] [reduce op] in body: a loop whose
+// iterations run in parallel on the runtime's thread pool. start and step are
+// integer constants and bound is evaluated once, before any iteration. The
+// body sees the enclosing variables but may not assign them, nor its own
+// variable. Evaluates to 0, or with reduce, to the body's values combined
+// with op: first within chunks of consecutive iterations, then the chunks in
+// order. The chunks depend only on the number of iterations, so the result is
+// the same on any number of threads. Only compiled code runs parfor.
+class ParforExprAST : public ExprAST {
+  SymbolID varName;
+  ExprAST *start, *bound, *step, *body;
+  char reduceOp; // 0 without reduce
 
 public:
-  ForExprAST(std::string_view varName, std::unique_ptr<ExprAST> start,
-             std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> step,
-             std::unique_ptr<ExprAST> body)
-      : varName(varName), start(std::move(start)), end(std::move(end)),
-        step(std::move(step)), body(std::move(body)) {}
+  ParforExprAST(SymbolID varName, ExprAST *start, ExprAST *bound,
+                ExprAST *step, ExprAST *body, char reduceOp)
+      : varName(varName), start(start), bound(bound), step(step), body(body),
+        reduceOp(reduceOp) {}
   Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override;
+};
+
+// Arrays of doubles: parameters declared as `name[]`, host memory declared
+// with `extern name[]`, and `var name[size] in body`. Only compiled code can
+// use them; tier 0 and the bytecode VM reject them.
+
+class IndexExprAST : public ExprAST {
+  SymbolID array;
+  ExprAST *index;
+
+public:
+  IndexExprAST(SymbolID array, ExprAST *index) : array(array), index(index) {}
+  Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override { return index->assigns(var); }
+};
+
+// array[index] = value; evaluates to value
+class ArrayStoreExprAST : public ExprAST {
+  SymbolID array;
+  ExprAST *index, *value;
+
+public:
+  ArrayStoreExprAST(SymbolID array, ExprAST *index, ExprAST *value)
+      : array(array), index(index), value(value) {}
+  Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override {
+    return index->assigns(var) || value->assigns(var);
+  }
+};
+
+// len(array)
+class ArrayLenExprAST : public ExprAST {
+  SymbolID array;
+
+public:
+  ArrayLenExprAST(SymbolID array) : array(array) {}
+  Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override { return false; }
+};
+
+// var name[size] in body: a zeroed array that lives until body is done
+class ArrayVarExprAST : public ExprAST {
+  SymbolID name;
+  ExprAST *size, *body;
+
+public:
+  ArrayVarExprAST(SymbolID name, ExprAST *size, ExprAST *body)
+      : name(name), size(size), body(body) {}
+  Value *codegen() override;
+  double eval(InterpFrame &frame) const override;
+  void emitBytecode(BytecodeBuilder &b, unsigned dst) const override;
+  void forEachCallee(function_ref<void(SymbolID)> fn) const override;
+  bool assigns(SymbolID var) const override {
+    return size->assigns(var) || body->assigns(var);
+  }
 };
 
 class PrototypeAST {
-  std::string name;
-  std::vector<std::string> args;
+  SymbolID name;
+  ArrayRef<SymbolID> args;
   bool isOperator;
   unsigned binPrecedence;
+  bool fastMath = false;
+  bool memo = false;
+  uint64_t arrayArgs = 0; // bit i set if argument i is an array
+  bool hostArray = false;
+  bool simd = false;
+  bool analyzed = false, pure = false, reachesMemo = false;
 
 public:
-  PrototypeAST(std::string_view name, std::vector<std::string> args,
-               bool isOperator = false, unsigned precedence = 0)
-      : name(name), args(std::move(args)), isOperator(isOperator),
+  PrototypeAST(SymbolID name, ArrayRef<SymbolID> args, bool isOperator = false,
+               unsigned precedence = 0)
+      : name(name), args(args), isOperator(isOperator),
         binPrecedence(precedence) {}
   Function *codegen();
-  const std::string &getName() const { return name; }
+  StringRef getName() const { return symbols.getName(name); }
+  SymbolID getNameID() const { return name; }
+  ArrayRef<SymbolID> getArgs() const { return args; }
 
   bool isUnaryOp() const { return isOperator && args.size() == 1; }
   bool isBinaryOp() const { return isOperator && args.size() == 2; }
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return name.back();
+    return getName().back();
   }
   unsigned getBinaryPrecedence() const { return binPrecedence; }
+
+  // body may be compiled with fast-math semantics (def fastmath ...)
+  bool isFastMath() const { return fastMath; }
+  void setFastMath(bool fast) { fastMath = fast; }
+
+  // results are cached (def memo ..., or chosen by -auto-memo)
+  bool isMemo() const { return memo; }
+  void setMemo(bool m) { memo = m; }
+
+  // has vector variants for the loop vectorizer (see simd.h)
+  bool isSimd() const { return simd; }
+  void setSimd(bool s) { simd = s; }
+
+  // the definition was analyzed (see analyzePurity in memo.h) and found pure
+  bool isAnalyzed() const { return analyzed; }
+  bool isPure() const { return pure; }
+  // calls a memoized function, directly or not, so it writes to memory (the
+  // cache) even if it is pure
+  bool isMemoCaller() const { return reachesMemo; }
+  void setAnalysis(bool p, bool memoCaller) {
+    analyzed = true;
+    pure = p;
+    reachesMemo = memoCaller;
+  }
+
+  // Array arguments are passed as a data pointer and an i64 length.
+  bool isArrayArg(size_t i) const { return arrayArgs >> i & 1; }
+  bool hasArrayArgs() const { return arrayArgs != 0; }
+  void setArrayArgs(uint64_t mask) { arrayArgs = mask; }
+
+  // not a function but an array the host provides (extern name[])
+  bool isHostArray() const { return hostArray; }
+  void setHostArray(bool h) { hostArray = h; }
 };
 
 class FunctionAST {
-  std::unique_ptr<PrototypeAST> proto;
-  std::unique_ptr<ExprAST> body;
+  PrototypeAST *proto;
+  ExprAST *body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> proto,
-              std::unique_ptr<ExprAST> body)
-      : proto(std::move(proto)), body(std::move(body)) {}
+  FunctionAST(PrototypeAST *proto, ExprAST *body) : proto(proto), body(body) {}
   Function *codegen();
+  // Emit the body into theFunc, which must be an empty function in the
+  // current module with this function's prototype.
+  bool codegenBody(Function *theFunc);
+  const PrototypeAST &getProto() const { return *proto; }
+  const ExprAST &getBody() const { return *body; }
 };
 
-inline std::unique_ptr<ExprAST> LogError(const char *str) {
+// Semantics of the built-in operators, shared by constant folding and the
+// interpreter. They must agree with the IR that codegen emits.
+inline bool isBuiltinBinOp(char op) {
+  return op == '+' || op == '-' || op == '*' || op == '/' || op == '<';
+}
+
+inline double evalBuiltinBinOp(char op, double l, double r) {
+  switch (op) {
+  case '+':
+    return l + r;
+  case '-':
+    return l - r;
+  case '*':
+    return l * r;
+  case '/':
+    return l / r;
+  default:
+    // fcmp ult: true if less or unordered
+    return (l < r || std::isnan(l) || std::isnan(r)) ? 1.0 : 0.0;
+  }
+}
+
+// Truth of an if or loop condition: fcmp one against 0.0.
+inline bool isTrue(double v) { return v != 0.0 && !std::isnan(v); }
+
+// Set on a thread that recovers from errors, such as a session of -serve:
+// LogError appends the message here and returns null instead of ending the
+// process. Callers pass the null up, as they do for any failure.
+inline thread_local std::string *errorLog = nullptr;
+
+inline ExprAST *LogError(const char *str) {
+  if (errorLog) {
+    *errorLog += "Error: ";
+    *errorLog += str;
+    if (errorLog->back() != '\n')
+      errorLog->push_back('\n');
+    return nullptr;
+  }
   fprintf(stderr, "Error: %s", str);
   fflush(stderr);
   abort();
   return nullptr;
-}
\ No newline at end of file
+}
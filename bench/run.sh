@@ -0,0 +1,75 @@
+#!/bin/sh
+# Run the benchmark workloads and print one JSON object per run on stdout:
+#
+#   {"workload": "fib", "flags": "", "run": 1, "commit": "abc1234",
+#    "phases_ms": {...}, "total_ms": ..., "peak_rss_bytes": ..., ...}
+#
+# Everything after "commit" is the -pipeline-stats=json report of that run.
+# Save the output of two commits and diff them, or load it with any JSON-lines
+# tool.
+#
+# Usage: bench/run.sh [path/to/main]
+#   RUNS=<n>        runs per workload (default 3)
+#   KAL_FLAGS=...   extra flags for every run, e.g. "-O3 -jit-threads=4"
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+main=${1:-$here/../main}
+runs=${RUNS:-3}
+commit=$(git -C "$here" rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# compile-heavy: thousands of small definitions, each calling the previous one
+awk -v n=3000 'BEGIN {
+  print "def f0(a b) a * b + 1;"
+  for (i = 1; i < n; i++)
+    printf "def f%d(a b) var t = a * b + %d in if t < a then f%d(t, b) else t - f%d(a, b * 0.5);\n", i, i, i - 1, i - 1
+  printf "f%d(1, 0.5);\n", n - 1
+}' > "$tmp/defs.kal"
+
+# REPL latency: many small top-level expressions, each compiled on its own
+awk -v n=5000 'BEGIN {
+  print "def sq(x) x * x;"
+  for (i = 0; i < n; i++)
+    printf "sq(%d) + %d * 0.5;\n", i, i
+}' > "$tmp/repl.kal"
+
+# name|input|flags
+workloads="defs|$tmp/defs.kal|
+defs-batch|$tmp/defs.kal|-batch
+repl|$tmp/repl.kal|
+fib|$here/fib.kal|
+fib-memo|$here/fib.kal|-auto-memo
+loops|$here/loops.kal|
+reduction|$here/reduction.kal|-batch
+arrays|$here/arrays.kal|-batch
+arrays-nocheck|$here/arrays.kal|-batch -bounds-check=false
+simd|$here/simd.kal|-bounds-check=false -cross-def-inline=false
+simd-scalar|$here/simd.kal|-bounds-check=false -cross-def-inline=false -simd-width=0
+mandelbrot|$here/mandelbrot.kal|
+parfor-1|$here/parfor.kal|-threads=1
+parfor-2|$here/parfor.kal|-threads=2
+parfor-4|$here/parfor.kal|-threads=4
+parfor|$here/parfor.kal|
+mandelbrot-bc|$here/mandelbrot.kal|-bc"
+
+echo "$workloads" | while IFS='|' read -r name input flags; do
+  allflags=$(echo $flags $KAL_FLAGS)
+  run=1
+  while [ "$run" -le "$runs" ]; do
+    # shellcheck disable=SC2086
+    "$main" -v=quiet -pipeline-stats=json $allflags "$input" \
+      >/dev/null 2>"$tmp/stderr" </dev/null || {
+      echo "bench: $name failed:" >&2
+      cat "$tmp/stderr" >&2
+      exit 1
+    }
+    report=$(grep '^{"phases_ms"' "$tmp/stderr" | tail -n 1)
+    printf '{"workload": "%s", "flags": "%s", "run": %d, "commit": "%s", %s\n' \
+      "$name" "$allflags" "$run" "$commit" "${report#\{}"
+    run=$((run + 1))
+  done
+done
@@ -0,0 +1,630 @@
+#include "bytecode.h"
+#include "codegen.h"
+#include "common.h"
+#include "parser.h"
+#include "stats.h"
+#include "tier.h"
+
+#include <algorithm>
+
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+class BytecodeCompiler {
+  // index + 1 into module.functions and module.externs, 0 if none
+  SymbolMap<unsigned> functionIndex;
+  SymbolMap<unsigned> externIndex;
+  // (function, number of arguments) of every CALL, checked at the end since
+  // functions may be called before they are defined
+  std::vector<std::pair<unsigned, unsigned>> calls;
+
+  unsigned getFunction(SymbolID name) {
+    unsigned &index = functionIndex[name];
+    if (!index) {
+      module.functions.emplace_back().name = symbols.getName(name).str();
+      index = module.functions.size();
+    }
+    return index - 1;
+  }
+
+  BCFunction compile(const FunctionAST &def, StringRef name);
+
+public:
+  BytecodeModule module;
+
+  void addExtern(const PrototypeAST &proto);
+  void addDefinition(const FunctionAST &def);
+  void addTopLevelExpr(const FunctionAST &expr);
+  void emitCall(BytecodeBuilder &b, SymbolID callee, unsigned dst,
+                unsigned argBase, unsigned numArgs);
+  void checkCalls() const;
+};
+
+// Compile with left operands read in place first; that is only safe without
+// assignments, so functions that have any are compiled again with copies.
+BCFunction BytecodeCompiler::compile(const FunctionAST &def, StringRef name) {
+  ArrayRef<SymbolID> params = def.getProto().getArgs();
+  if (def.getProto().hasArrayArgs())
+    LogError("arrays are not supported in bytecode");
+  for (bool aliasLHS : {true, false}) {
+    BytecodeBuilder b(*this, aliasLHS);
+    for (SymbolID param : params)
+      b.bind(param, b.allocReg());
+    unsigned result = def.getBody().emitBytecodeOperand(b);
+    b.emit(OP_RET, result);
+    if (!aliasLHS || !b.hasAssignments)
+      return b.finish(name, params.size());
+  }
+  llvm_unreachable("the second attempt always finishes");
+}
+
+void BytecodeCompiler::addExtern(const PrototypeAST &proto) {
+  unsigned &index = externIndex[proto.getNameID()];
+  if (index)
+    return;
+  if (proto.getArgs().size() > maxNativeArgs)
+    LogError("too many arguments for an extern called from bytecode");
+  if (proto.isHostArray() || proto.hasArrayArgs())
+    LogError("arrays are not supported in bytecode");
+  BCExtern &e = module.externs.emplace_back();
+  e.name = proto.getName().str();
+  e.numParams = proto.getArgs().size();
+  index = module.externs.size();
+}
+
+void BytecodeCompiler::addDefinition(const FunctionAST &def) {
+  const PrototypeAST &proto = def.getProto();
+  unsigned index = getFunction(proto.getNameID());
+  if (module.functions[index].defined)
+    LogError("function cannot be redefined");
+  BCFunction f = compile(def, proto.getName());
+  module.functions[index] = std::move(f);
+}
+
+void BytecodeCompiler::addTopLevelExpr(const FunctionAST &expr) {
+  std::string name = std::string(ANON_EXPR_NAME) + "." +
+                     std::to_string(module.topLevel.size());
+  BCFunction f = compile(expr, name);
+  module.topLevel.push_back(module.functions.size());
+  module.functions.push_back(std::move(f));
+}
+
+void BytecodeCompiler::emitCall(BytecodeBuilder &b, SymbolID callee,
+                                unsigned dst, unsigned argBase,
+                                unsigned numArgs) {
+  // a definition of the same name wins, as it does in the JIT
+  if (unsigned e = externIndex.lookup(callee); e && !functionIndex.lookup(callee)) {
+    if (module.externs[e - 1].numParams != numArgs)
+      LogError("incorrect # of arguments passed");
+    b.emit(OP_CALLX, dst, e - 1, argBase);
+    return;
+  }
+  unsigned index = getFunction(callee);
+  calls.emplace_back(index, numArgs);
+  b.emit(OP_CALL, dst, index, argBase);
+}
+
+void BytecodeCompiler::checkCalls() const {
+  for (auto [index, numArgs] : calls) {
+    const BCFunction &f = module.functions[index];
+    if (!f.defined) {
+      std::string msg = "unknown function referenced: " + f.name;
+      LogError(msg.c_str());
+    }
+    if (f.numParams != numArgs)
+      LogError("incorrect # of arguments passed");
+  }
+}
+
+std::unique_ptr<BytecodeModule> compileBytecode() {
+  BytecodeCompiler compiler;
+  while (true) {
+    while (curTok == 0 || curTok == ';') // ignore top level semicolon
+      getNextToken();
+    switch (curTok) {
+    case tok_eof: {
+      compiler.checkCalls();
+      auto module = std::make_unique<BytecodeModule>(std::move(compiler.module));
+      size_t insts = 0;
+      for (const BCFunction &f : module->functions)
+        insts += f.code.size();
+      LogInfo("bytecode: %zu functions, %zu instructions\n",
+              module->functions.size(), insts);
+      return module;
+    }
+    case tok_def:
+      if (auto *def = parseDefinition()) {
+        installBinaryOperator(def->getProto());
+        PhaseTimer timer(Phase::codegen);
+        compiler.addDefinition(*def);
+      } else {
+        getNextToken(); // skip next token
+      }
+      break;
+    case tok_extern:
+      if (auto *proto = parseExtern())
+        compiler.addExtern(*proto);
+      else
+        getNextToken(); // skip next token
+      break;
+    default:
+      if (auto *expr = parseTopLevelExpr()) {
+        {
+          PhaseTimer timer(Phase::codegen);
+          compiler.addTopLevelExpr(*expr);
+        }
+        exprArena.reset();
+      } else {
+        getNextToken(); // skip next token
+      }
+      break;
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// BytecodeBuilder
+//===----------------------------------------------------------------------===//
+
+unsigned BytecodeBuilder::allocReg() {
+  if (top == UINT16_MAX)
+    LogError("function needs too many registers for bytecode");
+  unsigned reg = top++;
+  out.numRegs = std::max<unsigned>(out.numRegs, top);
+  return reg;
+}
+
+std::optional<unsigned> BytecodeBuilder::lookup(SymbolID name) const {
+  for (auto it = vars.rbegin(), end = vars.rend(); it != end; ++it)
+    if (it->first == name)
+      return it->second;
+  return std::nullopt;
+}
+
+unsigned BytecodeBuilder::constant(double val) {
+  // literals are never NaN, so the bit patterns DenseMap reserves can't occur
+  auto [it, inserted] =
+      constIndex.try_emplace(bit_cast<uint64_t>(val), out.consts.size());
+  if (inserted) {
+    if (out.consts.size() == UINT16_MAX)
+      LogError("function has too many constants for bytecode");
+    out.consts.push_back(val);
+  }
+  return it->second;
+}
+
+size_t BytecodeBuilder::emit(Opcode op, unsigned a, unsigned b, unsigned c) {
+  if (out.code.size() == UINT16_MAX)
+    LogError("function is too long for bytecode");
+  out.code.push_back({op, (uint16_t)a, (uint16_t)b, (uint16_t)c});
+  return out.code.size() - 1;
+}
+
+void BytecodeBuilder::setJumpTarget(size_t jump, size_t target) {
+  out.code[jump].b = target;
+}
+
+void BytecodeBuilder::emitCall(SymbolID callee, unsigned dst, unsigned argBase,
+                               unsigned numArgs) {
+  compiler.emitCall(*this, callee, dst, argBase, numArgs);
+}
+
+BCFunction BytecodeBuilder::finish(StringRef name, unsigned numParams) {
+  out.name = name.str();
+  out.numParams = numParams;
+  out.defined = true;
+  return std::move(out);
+}
+
+//===----------------------------------------------------------------------===//
+// ExprAST::emitBytecode
+//===----------------------------------------------------------------------===//
+
+unsigned ExprAST::emitBytecodeOperand(BytecodeBuilder &b) const {
+  unsigned reg = b.allocReg();
+  emitBytecode(b, reg);
+  return reg;
+}
+
+void NumberExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  b.emit(OP_LOADK, dst, b.constant(val));
+}
+
+unsigned VariableExprAST::emitBytecodeOperand(BytecodeBuilder &b) const {
+  std::optional<unsigned> reg = b.lookup(name);
+  if (!reg)
+    LogError("unknown variable name");
+  return *reg;
+}
+
+void VariableExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  b.emit(OP_MOV, dst, emitBytecodeOperand(b));
+}
+
+void VarExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  unsigned mark = b.mark();
+  size_t scope = b.pushScope();
+  for (const auto &p : varNames) {
+    unsigned reg = b.allocReg();
+    if (p.second)
+      p.second->emitBytecode(b, reg);
+    else
+      b.emit(OP_LOADK, reg, b.constant(0.0));
+    b.bind(p.first, reg);
+  }
+  body->emitBytecode(b, dst);
+  b.popScope(scope);
+  b.release(mark);
+}
+
+void UnaryExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  unsigned mark = b.mark();
+  b.emitCall(operatorSymbol(false, op), dst, operand->emitBytecodeOperand(b),
+             1);
+  b.release(mark);
+}
+
+void BinaryExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  if (op == '=') {
+    auto *var = static_cast<VariableExprAST *>(lhs);
+    unsigned reg = var->emitBytecodeOperand(b);
+    b.hasAssignments = true;
+    rhs->emitBytecode(b, dst);
+    b.emit(OP_MOV, reg, dst);
+    return;
+  }
+
+  unsigned mark = b.mark();
+  if (!isBuiltinBinOp(op)) {
+    // a call of the operator function with both operands as arguments
+    unsigned args = b.allocReg();
+    b.allocReg();
+    lhs->emitBytecode(b, args);
+    rhs->emitBytecode(b, args + 1);
+    b.emitCall(operatorSymbol(true, op), dst, args, 2);
+    b.release(mark);
+    return;
+  }
+
+  unsigned l;
+  if (b.aliasLHS) {
+    l = lhs->emitBytecodeOperand(b);
+  } else {
+    l = b.allocReg();
+    lhs->emitBytecode(b, l);
+  }
+  unsigned r = rhs->emitBytecodeOperand(b);
+  Opcode opcode;
+  switch (op) {
+  case '+':
+    opcode = OP_ADD;
+    break;
+  case '-':
+    opcode = OP_SUB;
+    break;
+  case '*':
+    opcode = OP_MUL;
+    break;
+  case '/':
+    opcode = OP_DIV;
+    break;
+  default:
+    opcode = OP_LT;
+    break;
+  }
+  b.emit(opcode, dst, l, r);
+  b.release(mark);
+}
+
+void CallExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  unsigned mark = b.mark();
+  unsigned argBase;
+  if (args.size() == 1) {
+    argBase = args[0]->emitBytecodeOperand(b);
+  } else {
+    argBase = b.mark();
+    for (size_t i = 0; i < args.size(); i++)
+      b.allocReg();
+    for (size_t i = 0; i < args.size(); i++)
+      args[i]->emitBytecode(b, argBase + i);
+  }
+  b.emitCall(callee, dst, argBase, args.size());
+  b.release(mark);
+}
+
+void IfExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  unsigned mark = b.mark();
+  size_t toElse = b.emit(OP_JF, cond->emitBytecodeOperand(b));
+  b.release(mark);
+  then_->emitBytecode(b, dst);
+  size_t toEnd = b.emit(OP_JMP);
+  b.setJumpTarget(toElse, b.here());
+  else_->emitBytecode(b, dst);
+  b.setJumpTarget(toEnd, b.here());
+}
+
+void ForExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  // same order as the generated loop: the end condition is checked after
+  // the body and the increment
+  unsigned mark = b.mark();
+  unsigned var = b.allocReg();
+  start->emitBytecode(b, var);
+  size_t scope = b.pushScope();
+  b.bind(varName, var);
+
+  size_t loop = b.here();
+  unsigned tmp = b.allocReg(); // body value, then the step
+  body->emitBytecode(b, tmp);
+  unsigned stepReg = tmp;
+  if (step)
+    stepReg = step->emitBytecodeOperand(b);
+  else
+    b.emit(OP_LOADK, tmp, b.constant(1.0));
+  b.emit(OP_ADD, var, var, stepReg);
+  b.emit(OP_JT, end->emitBytecodeOperand(b), loop);
+
+  b.popScope(scope);
+  b.release(mark);
+  b.emit(OP_LOADK, dst, b.constant(0.0));
+}
+
+void ParforExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  LogError("parfor is not supported in bytecode");
+}
+
+// registers only hold doubles
+static void noArrays() { LogError("arrays are not supported in bytecode"); }
+
+void IndexExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  noArrays();
+}
+
+void ArrayStoreExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  noArrays();
+}
+
+void ArrayLenExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  noArrays();
+}
+
+void ArrayVarExprAST::emitBytecode(BytecodeBuilder &b, unsigned dst) const {
+  noArrays();
+}
+
+//===----------------------------------------------------------------------===//
+// File format
+//===----------------------------------------------------------------------===//
+//
+// Little endian throughout:
+//   "KBC\1"
+//   u32 #externs,   each: string name, u16 #params
+//   u32 #functions, each: string name, u16 #params, u16 #registers,
+//                         u32 #constants, f64 each,
+//                         u32 #instructions, 4 x u16 each
+//   u32 #top-level, u32 function index each
+// where a string is a u32 length followed by its bytes.
+
+static const char bytecodeMagic[4] = {'K', 'B', 'C', 1};
+
+bool isBytecodeFile(const std::string &path) {
+  auto buf = MemoryBuffer::getFile(path);
+  return buf && (*buf)->getBuffer().startswith(
+                    StringRef(bytecodeMagic, sizeof(bytecodeMagic)));
+}
+
+bool writeBytecode(const BytecodeModule &module, const std::string &path) {
+  std::error_code ec;
+  raw_fd_ostream os(path, ec, sys::fs::OF_None);
+  if (ec) {
+    errs() << "cannot open " << path << ": " << ec.message() << "\n";
+    return false;
+  }
+  support::endian::Writer w(os, support::little);
+  auto writeString = [&](StringRef s) {
+    w.write<uint32_t>(s.size());
+    os << s;
+  };
+
+  os.write(bytecodeMagic, sizeof(bytecodeMagic));
+  w.write<uint32_t>(module.externs.size());
+  for (const BCExtern &e : module.externs) {
+    writeString(e.name);
+    w.write<uint16_t>(e.numParams);
+  }
+  w.write<uint32_t>(module.functions.size());
+  for (const BCFunction &f : module.functions) {
+    writeString(f.name);
+    w.write<uint16_t>(f.numParams);
+    w.write<uint16_t>(f.numRegs);
+    w.write<uint32_t>(f.consts.size());
+    for (double k : f.consts)
+      w.write<uint64_t>(bit_cast<uint64_t>(k));
+    w.write<uint32_t>(f.code.size());
+    for (const Instr &in : f.code) {
+      w.write<uint16_t>(in.op);
+      w.write<uint16_t>(in.a);
+      w.write<uint16_t>(in.b);
+      w.write<uint16_t>(in.c);
+    }
+  }
+  w.write<uint32_t>(module.topLevel.size());
+  for (uint32_t index : module.topLevel)
+    w.write<uint32_t>(index);
+
+  os.close();
+  if (os.has_error()) {
+    errs() << "cannot write " << path << ": " << os.error().message() << "\n";
+    os.clear_error();
+    return false;
+  }
+  return true;
+}
+
+namespace {
+class BytecodeReader {
+  const char *p, *end;
+
+public:
+  const char *error = nullptr; // first problem found
+
+  BytecodeReader(StringRef data) : p(data.begin()), end(data.end()) {}
+
+  bool atEnd() const { return p == end; }
+
+  template <typename T> T read() {
+    if (size_t(end - p) < sizeof(T)) {
+      error = error ? error : "truncated";
+      p = end;
+      return 0;
+    }
+    T val = support::endian::read<T>(p, support::little);
+    p += sizeof(T);
+    return val;
+  }
+
+  std::string readString() {
+    uint32_t size = read<uint32_t>();
+    if (size_t(end - p) < size) {
+      error = error ? error : "truncated";
+      p = end;
+      return "";
+    }
+    std::string s(p, size);
+    p += size;
+    return s;
+  }
+
+  // counts are checked against the bytes left before anything is reserved
+  uint32_t readCount(size_t minBytesEach) {
+    uint32_t n = read<uint32_t>();
+    if (size_t(end - p) / minBytesEach < n) {
+      error = error ? error : "truncated";
+      p = end;
+      return 0;
+    }
+    return n;
+  }
+};
+} // namespace
+
+// Everything the VM takes on trust: operands in range, calls with the right
+// number of arguments, and no way to run off the end of a function.
+static const char *validate(const BytecodeModule &module) {
+  for (const BCExtern &e : module.externs)
+    if (e.numParams > maxNativeArgs)
+      return "extern with too many parameters";
+  for (const BCFunction &f : module.functions) {
+    if (f.numParams > f.numRegs)
+      return "more parameters than registers";
+    if (f.code.empty())
+      return "empty function";
+    Opcode last = (Opcode)f.code.back().op;
+    if (last != OP_RET && last != OP_JMP)
+      return "function does not end in a return or jump";
+    auto reg = [&](unsigned r) { return r < f.numRegs; };
+    auto target = [&](unsigned t) { return t < f.code.size(); };
+    for (const Instr &in : f.code) {
+      bool ok;
+      switch (in.op) {
+      case OP_LOADK:
+        ok = reg(in.a) && in.b < f.consts.size();
+        break;
+      case OP_MOV:
+        ok = reg(in.a) && reg(in.b);
+        break;
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_LT:
+        ok = reg(in.a) && reg(in.b) && reg(in.c);
+        break;
+      case OP_JMP:
+        ok = target(in.b);
+        break;
+      case OP_JF:
+      case OP_JT:
+        ok = reg(in.a) && target(in.b);
+        break;
+      case OP_CALL:
+        ok = reg(in.a) && in.b < module.functions.size() &&
+             in.c + module.functions[in.b].numParams <= f.numRegs;
+        break;
+      case OP_CALLX:
+        ok = reg(in.a) && in.b < module.externs.size() &&
+             in.c + module.externs[in.b].numParams <= f.numRegs;
+        break;
+      case OP_RET:
+        ok = reg(in.a);
+        break;
+      default:
+        return "unknown opcode";
+      }
+      if (!ok)
+        return "operand out of range";
+    }
+  }
+  for (uint32_t index : module.topLevel)
+    if (index >= module.functions.size() ||
+        module.functions[index].numParams != 0)
+      return "bad top-level function";
+  return nullptr;
+}
+
+std::unique_ptr<BytecodeModule> readBytecode(const std::string &path) {
+  auto buf = MemoryBuffer::getFile(path);
+  if (!buf) {
+    errs() << "cannot open " << path << ": " << buf.getError().message()
+           << "\n";
+    return nullptr;
+  }
+  StringRef data = (*buf)->getBuffer();
+  StringRef magic(bytecodeMagic, sizeof(bytecodeMagic));
+  if (!data.startswith(magic)) {
+    errs() << path << ": not a bytecode file\n";
+    return nullptr;
+  }
+
+  BytecodeReader r(data.drop_front(magic.size()));
+  auto module = std::make_unique<BytecodeModule>();
+  module->externs.resize(r.readCount(6));
+  for (BCExtern &e : module->externs) {
+    e.name = r.readString();
+    e.numParams = r.read<uint16_t>();
+  }
+  module->functions.resize(r.readCount(16));
+  for (BCFunction &f : module->functions) {
+    f.name = r.readString();
+    f.numParams = r.read<uint16_t>();
+    f.numRegs = r.read<uint16_t>();
+    f.consts.resize(r.readCount(8));
+    for (double &k : f.consts)
+      k = bit_cast<double>(r.read<uint64_t>());
+    f.code.resize(r.readCount(8));
+    for (Instr &in : f.code) {
+      in.op = r.read<uint16_t>();
+      in.a = r.read<uint16_t>();
+      in.b = r.read<uint16_t>();
+      in.c = r.read<uint16_t>();
+    }
+    f.defined = true;
+  }
+  module->topLevel.resize(r.readCount(4));
+  for (uint32_t &index : module->topLevel)
+    index = r.read<uint32_t>();
+
+  const char *error = r.error;
+  if (!error && !r.atEnd())
+    error = "trailing data";
+  if (!error)
+    error = validate(*module);
+  if (error) {
+    errs() << path << ": invalid bytecode file (" << error << ")\n";
+    return nullptr;
+  }
+  return module;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+// Register bytecode for a whole program, and the VM that runs it (-bc).
+// Loading and running bytecode needs neither the parser nor LLVM's JIT, and
+// compiled programs can be saved with -emit-bc and reloaded without parsing.
+//
+// Each function has a window of double registers; parameters occupy the
+// first ones. Instructions are four 16-bit fields: an opcode and up to three
+// operands (registers, constant or function indices, or jump targets).
+
+#define KAL_OPCODES(X)                                                         \
+  X(LOADK) /* R[a] = K[b] */                                                   \
+  X(MOV)   /* R[a] = R[b] */                                                   \
+  X(ADD)   /* R[a] = R[b] + R[c] */                                            \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(DIV)                                                                       \
+  X(LT)    /* R[a] = R[b] < R[c] (unordered counts as less) */                 \
+  X(JMP)   /* pc = b */                                                        \
+  X(JF)    /* if !R[a] pc = b */                                               \
+  X(JT)    /* if R[a] pc = b */                                                \
+  X(CALL)  /* R[a] = functions[b](R[c], ...) */                                \
+  X(CALLX) /* R[a] = externs[b](R[c], ...) */                                  \
+  X(RET)   /* return R[a] */
+
+enum Opcode : uint16_t {
+#define X(name) OP_##name,
+  KAL_OPCODES(X)
+#undef X
+  NUM_OPCODES
+};
+
+struct Instr {
+  uint16_t op, a, b, c;
+};
+
+struct BCFunction {
+  std::string name;
+  uint16_t numParams = 0;
+  uint16_t numRegs = 0;
+  std::vector<double> consts;
+  std::vector<Instr> code;
+  bool defined = false; // false while only referenced by calls
+};
+
+struct BCExtern {
+  std::string name;
+  uint16_t numParams = 0;
+  void *addr = nullptr; // resolved in the process before running
+};
+
+struct BytecodeModule {
+  std::vector<BCFunction> functions;
+  std::vector<BCExtern> externs;
+  std::vector<uint32_t> topLevel; // functions to run, in source order
+};
+
+// Compile everything the lexer delivers until end of input.
+std::unique_ptr<BytecodeModule> compileBytecode();
+
+// Serialized form; readBytecode validates everything the VM relies on and
+// returns null (after reporting why) if the file is not usable.
+bool isBytecodeFile(const std::string &path);
+bool writeBytecode(const BytecodeModule &module, const std::string &path);
+std::unique_ptr<BytecodeModule> readBytecode(const std::string &path);
+
+// Resolve externs and run the top-level functions, printing their values.
+int runBytecode(BytecodeModule &module);
+
+// Whole-program state of the bytecode compiler; see bytecode.cpp.
+class BytecodeCompiler;
+
+// Per-function state of the bytecode compiler, driven by
+// ExprAST::emitBytecode. Registers are allocated like a stack: temporaries
+// and variables are released by resetting to a mark on scope exit.
+class BytecodeBuilder {
+  BytecodeCompiler &compiler;
+  BCFunction out;
+  SmallVector<std::pair<SymbolID, unsigned>, 16> vars;
+  unsigned top = 0;
+  DenseMap<uint64_t, unsigned> constIndex;
+
+public:
+  // Whether a variable register may be read in place as a binary operator's
+  // left operand. Only safe if the right operand cannot assign to it, so it
+  // is turned off for functions that contain assignments.
+  bool aliasLHS;
+  bool hasAssignments = false;
+
+  BytecodeBuilder(BytecodeCompiler &compiler, bool aliasLHS)
+      : compiler(compiler), aliasLHS(aliasLHS) {}
+
+  unsigned allocReg();
+  unsigned mark() const { return top; }
+  void release(unsigned mark) { top = mark; }
+
+  void bind(SymbolID name, unsigned reg) { vars.emplace_back(name, reg); }
+  size_t pushScope() const { return vars.size(); }
+  void popScope(size_t scope) { vars.resize(scope); }
+  std::optional<unsigned> lookup(SymbolID name) const;
+
+  unsigned constant(double val);
+  size_t emit(Opcode op, unsigned a = 0, unsigned b = 0, unsigned c = 0);
+  size_t here() const { return out.code.size(); }
+  void setJumpTarget(size_t jump, size_t target);
+  void emitCall(SymbolID callee, unsigned dst, unsigned argBase,
+                unsigned numArgs);
+
+  BCFunction finish(StringRef name, unsigned numParams);
+};
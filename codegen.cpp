@@ -1,7 +1,11 @@
 #include "codegen.h"
 #include "ast.h"
+#include "common.h"
 #include "jit.h"
+#include "memo.h"
 #include "parser.h"
+#include "simd.h"
+#include "stats.h"
 
 #include <functional>
 #include <map>
@@ -11,35 +15,183 @@
 #include <vector>
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/CallGraphSCCPass.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
-#include "llvm/Transforms/Utils.h"
-#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
 
-static std::map<std::string, AllocaInst *> namedValues;
-std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+Verbosity verbosity;
+static cl::opt<Verbosity, true> verbosityOpt(
+    "v", cl::desc("How much to report on stderr (default = ir)"),
+    cl::values(clEnumValN(Verbosity::quiet, "quiet", "Results only"),
+               clEnumValN(Verbosity::info, "info",
+                          "Progress messages and statistics"),
+               clEnumValN(Verbosity::ir, "ir",
+                          "Also print each function's IR"),
+               clEnumValN(Verbosity::passes, "passes",
+                          "Also log every pass and the IR after it")),
+    cl::location(verbosity), cl::init(Verbosity::ir));
+
+static cl::opt<char>
+    optLevel("O",
+             cl::desc("Optimization level: -O0, -O1, -O2, -O3, -Os or -Oz "
+                      "(default = -O2)"),
+             cl::Prefix, cl::init('2'));
+
+static cl::opt<char> exprOptLevel(
+    "expr-O",
+    cl::desc("Optimization level for top-level expressions, which run once "
+             "(default = -expr-O0)"),
+    cl::Prefix, cl::init('0'));
+
+static cl::opt<std::string>
+    targetCPU("cpu",
+              cl::desc("CPU to generate code for (default: the host CPU). "
+                       "Pin this for reproducible output"),
+              cl::value_desc("name"), cl::init(""));
+
+static cl::opt<std::string> targetFeatures(
+    "cpu-features",
+    cl::desc("Comma-separated target features to enable or disable on top of "
+             "the CPU's own, e.g. +avx2,-avx512f"),
+    cl::value_desc("features"), cl::init(""));
+
+static cl::opt<bool> fastMath(
+    "fast-math",
+    cl::desc("Compile every function with fast-math semantics, allowing "
+             "reassociation, FMA contraction and vectorized reductions"),
+    cl::init(false));
+
+static cl::opt<bool>
+    lazyCompile("lazy",
+                cl::desc("Compile function bodies on first call instead of "
+                         "when they are defined"),
+                cl::init(false));
+
+static cl::opt<unsigned> compileThreads(
+    "jit-threads",
+    cl::desc("Number of worker threads compiling definitions in the "
+             "background (0 = compile on the main thread when first used)"),
+    cl::init(0));
+
+static cl::opt<std::string>
+    cacheDir("cache-dir",
+             cl::desc("Directory for caching compiled objects across runs"),
+             cl::value_desc("dir"), cl::init(""));
+
+static cl::opt<unsigned>
+    cacheSizeMB("cache-size",
+                cl::desc("Maximum size of the object cache in MiB"),
+                cl::value_desc("MiB"), cl::init(256));
+
+static cl::opt<bool> boundsCheck(
+    "bounds-check",
+    cl::desc("Check array indices at run time (default on). Loops over "
+             "arrays only vectorize without the checks"),
+    cl::init(true));
+
+static cl::opt<bool> crossDefInline(
+    "cross-def-inline",
+    cl::desc("Copy the bodies of previously defined functions into each new "
+             "module as available_externally so they can be inlined"),
+    cl::init(true));
+
+static ExitOnError exitOnError;
+
+// Variables in scope, indexed by symbol. Binding a name records the value it
+// shadows so that leaving a scope is a pop rather than a map rebuild.
+template <typename T> class ScopedBindings {
+  SymbolMap<T> values;
+  std::vector<std::pair<SymbolID, T>> shadowed;
+
+public:
+  T lookup(SymbolID name) const { return values.lookup(name); }
+  void bind(SymbolID name, T a) {
+    shadowed.emplace_back(name, values[name]);
+    values[name] = a;
+  }
+  // Call fn(name, value) for each name currently bound, innermost first.
+  void forEachBinding(function_ref<void(SymbolID, T)> fn) const {
+    SmallDenseSet<SymbolID, 16> seen;
+    for (auto it = shadowed.rbegin(); it != shadowed.rend(); ++it)
+      if (seen.insert(it->first).second)
+        fn(it->first, values.lookup(it->first));
+  }
+  size_t pushScope() const { return shadowed.size(); }
+  void popScope(size_t scope) {
+    while (shadowed.size() > scope) {
+      values[shadowed.back().first] = shadowed.back().second;
+      shadowed.pop_back();
+    }
+  }
+};
+
+static ScopedBindings<AllocaInst *> namedValues;
+SymbolMap<PrototypeAST *> functionProtos;
+SymbolMap<FunctionAST *> functionDefs;
+SymbolMap<PrototypeAST *> hostArrays;
+
+// Where the data pointer and the i64 length of an array in scope are loaded
+// from: allocas for parameters and `var name[n]`, the fields of the KalArray
+// descriptor for host arrays.
+struct ArrayBinding {
+  Value *data = nullptr;
+  Value *length = nullptr;
+};
+static ScopedBindings<ArrayBinding> arrayValues;
+
+// The variable of a counted loop (see ForExprAST::codegenCounted) and the i64
+// it equals in the loop body, for indexing arrays without a conversion.
+struct LoopCounter {
+  AllocaInst *var = nullptr;
+  Value *count = nullptr;
+};
+static ScopedBindings<LoopCounter> loopCounters;
+
+// Self-recursive calls in tail position are emitted as a jump back to the top
+// of the function, with the arguments stored to the parameters' allocas.
+// mem2reg turns that into a loop, so deep recursion runs in constant stack.
+struct TailCallState {
+  Function *func = nullptr;
+  BasicBlock *header = nullptr; // after the parameters are spilled
+  SmallVector<AllocaInst *, 4> params;
+  // the expression whose value is returned, if it is being emitted; a
+  // subexpression is in tail position iff it's set to it before its codegen
+  const ExprAST *tailExpr = nullptr;
+};
+static TailCallState tailCalls;
+
+SymbolID operatorSymbol(bool binary, char op) {
+  static const SymbolID none = ~0u;
+  static std::vector<SymbolID> syms(2 * 256, none);
+  SymbolID &sym = syms[binary * 256 + (unsigned char)op];
+  if (sym == none)
+    sym = symbols.internPermanent((binary ? "binary" : "unary") +
+                                  std::string(1, op));
+  return sym;
+}
 
 std::unique_ptr<LLVMContext> theContext;
 std::unique_ptr<Module> theModule;
 std::unique_ptr<IRBuilder<>> Builder;
 // std::unique_ptr<KaleidoscopeJIT> theJIT;
-static std::unique_ptr<FunctionPassManager> theFPM;
+static std::unique_ptr<TargetMachine> theTM;
+static std::unique_ptr<ModulePassManager> theMPM;
 static std::unique_ptr<LoopAnalysisManager> theLAM;
 static std::unique_ptr<FunctionAnalysisManager> theFAM;
 static std::unique_ptr<CGSCCAnalysisManager> theCGAM;
@@ -48,83 +200,458 @@ static std::unique_ptr<PassInstrumentationCallbacks> thePIC;
 static std::unique_ptr<StandardInstrumentations> theSI;
 std::unique_ptr<orc::KaleidoscopeJIT> theJIT;
 
+// optimization level of the current session, 0 until set with setOptLevel
+static char sessionOptLevel = 0;
+
+void setOptLevel(char level) { sessionOptLevel = level; }
+
+static char getOptLevel() {
+  return sessionOptLevel ? sessionOptLevel : optLevel;
+}
+
+// level the current module is optimized at
+static char moduleOptLevel;
+
+static OptimizationLevel getOptimizationLevel(char level) {
+  switch (level) {
+  case '0':
+    return OptimizationLevel::O0;
+  case '1':
+    return OptimizationLevel::O1;
+  case '2':
+    return OptimizationLevel::O2;
+  case '3':
+    return OptimizationLevel::O3;
+  case 's':
+    return OptimizationLevel::Os;
+  case 'z':
+    return OptimizationLevel::Oz;
+  default:
+    LogError("invalid optimization level, expected -O0, -O1, -O2, -O3, -Os "
+             "or -Oz\n");
+    return OptimizationLevel::O2;
+  }
+}
+
+// like clang, only vectorize from -O2 (and the size levels) up
+static bool vectorizesAt(char level) {
+  return getOptimizationLevel(level).getSpeedupLevel() > 1;
+}
+
+static CodeGenOpt::Level getCodeGenOptLevel(char level) {
+  switch (level) {
+  case '0':
+    return CodeGenOpt::None;
+  case '1':
+    return CodeGenOpt::Less;
+  case '3':
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+static orc::JITTargetMachineBuilder getTargetMachineBuilder() {
+  // target the host's CPU and vector extensions unless a CPU is pinned
+  orc::JITTargetMachineBuilder JTMB(Triple(sys::getProcessTriple()));
+  if (targetCPU.empty() || targetCPU == "host")
+    JTMB = exitOnError(orc::JITTargetMachineBuilder::detectHost());
+  else
+    JTMB.setCPU(targetCPU);
+
+  if (!targetFeatures.empty()) {
+    SmallVector<StringRef, 8> features;
+    StringRef(targetFeatures).split(features, ',', -1, false);
+    JTMB.addFeatures(std::vector<std::string>(features.begin(), features.end()));
+  }
+  JTMB.setCodeGenOptLevel(getCodeGenOptLevel(getOptLevel()));
+  LogDebug("target %s, cpu %s, features %s\n",
+           JTMB.getTargetTriple().str().c_str(), JTMB.getCPU().c_str(),
+           JTMB.getFeatures().getString().c_str());
+  return JTMB;
+}
+
 void initModuleAndPassMgr() {
   theContext = std::make_unique<LLVMContext>();
   theModule = std::make_unique<Module>("Kaleidoscope-jit", *theContext);
-  theModule->setDataLayout(theJIT->getDataLayout());
+  theModule->setDataLayout(theTM->createDataLayout());
+  theModule->setTargetTriple(theTM->getTargetTriple().str());
   Builder = std::make_unique<IRBuilder<>>(*theContext);
+  moduleOptLevel = getOptLevel();
+  // the JIT was set up for -O; tell it to generate this module's code at the
+  // session's level instead
+  if (sessionOptLevel)
+    theModule->addModuleFlag(Module::Warning,
+                             orc::LevelIRCompiler::LevelFlag,
+                             getCodeGenOptLevel(sessionOptLevel));
+  // built by optimizeModule, once the module's level is final
+  theMPM.reset();
+}
+
+void initExprModule() {
+  moduleOptLevel = exprOptLevel;
+}
 
-  // Create new pass and analysis managers
-  theFPM = std::make_unique<FunctionPassManager>();
+static void initPassMgr() {
+  // Create new pass and analysis managers. The old ones go first, outermost
+  // first: the module manager's cached proxies still point at the others.
+  theMAM.reset();
+  theCGAM.reset();
+  theFAM.reset();
+  theLAM.reset();
   theLAM = std::make_unique<LoopAnalysisManager>();
   theFAM = std::make_unique<FunctionAnalysisManager>();
   theCGAM = std::make_unique<CGSCCAnalysisManager>();
   theMAM = std::make_unique<ModuleAnalysisManager>();
   thePIC = std::make_unique<PassInstrumentationCallbacks>();
-  theSI = std::make_unique<StandardInstrumentations>(*theContext, true);
-  theSI->registerCallbacks(*thePIC, theMAM.get());
-
-  // add transformation passes
-  theFPM->addPass(PromotePass());
-  theFPM->addPass(InstCombinePass());
-  theFPM->addPass(ReassociatePass());
-  theFPM->addPass(GVNPass());
-  theFPM->addPass(SimplifyCFGPass());
-  PassBuilder pb;
+  if (verbosity >= Verbosity::passes) {
+    theSI = std::make_unique<StandardInstrumentations>(*theContext, true);
+    theSI->registerCallbacks(*thePIC, theMAM.get());
+    thePIC->registerAfterPassCallback(
+        [](StringRef pass, Any ir, const PreservedAnalyses &) {
+          errs() << "*** IR after " << pass << " ***\n";
+          if (const auto *m = any_cast<const Module *>(&ir))
+            (*m)->print(errs(), nullptr);
+          else if (const auto *f = any_cast<const Function *>(&ir))
+            (*f)->print(errs());
+        });
+  } else {
+    theSI.reset();
+  }
+
+  // use LLVM's standard pipeline for the requested level
+  OptimizationLevel level = getOptimizationLevel(moduleOptLevel);
+  PipelineTuningOptions pto;
+  pto.LoopVectorization = vectorizesAt(moduleOptLevel);
+  pto.SLPVectorization = vectorizesAt(moduleOptLevel);
+  PassBuilder pb(theTM.get(), pto, std::nullopt, thePIC.get());
   pb.registerModuleAnalyses(*theMAM);
+  pb.registerCGSCCAnalyses(*theCGAM);
   pb.registerFunctionAnalyses(*theFAM);
+  pb.registerLoopAnalyses(*theLAM);
   pb.crossRegisterProxies(*theLAM, *theFAM, *theCGAM, *theMAM);
+
+  if (level == OptimizationLevel::O0)
+    theMPM = std::make_unique<ModulePassManager>(
+        pb.buildO0DefaultPipeline(level));
+  else
+    theMPM = std::make_unique<ModulePassManager>(
+        pb.buildPerModuleDefaultPipeline(level));
+}
+
+// IR instructions in the functions this module defines (not the
+// available_externally copies of earlier ones)
+static uint64_t countInstructions(const Module &m) {
+  uint64_t n = 0;
+  for (const Function &f : m)
+    if (!f.isDeclaration() && !f.hasAvailableExternallyLinkage())
+      n += f.getInstructionCount();
+  return n;
+}
+
+void optimizeModule() {
+  PhaseTimer timer(Phase::optimize);
+  if (!theMPM)
+    initPassMgr();
+  if (stats::enabled())
+    stats::counters.instsBefore += countInstructions(*theModule);
+  theMPM->run(*theModule, *theMAM);
+  if (stats::enabled())
+    stats::counters.instsAfter += countInstructions(*theModule);
+}
+
+void initJIT() {
+  auto JTMB = getTargetMachineBuilder();
+  theTM = exitOnError(JTMB.createTargetMachine());
+
+  std::unique_ptr<KaleidoscopeObjectCache> objCache;
+  if (!cacheDir.empty()) {
+    // everything besides the IR that affects the emitted object, including
+    // the LLVM that emits it
+    std::string settings = std::string(LLVM_VERSION_STRING) + ";" +
+                           JTMB.getTargetTriple().str() + ";" +
+                           JTMB.getCPU() + ";" +
+                           JTMB.getFeatures().getString() + ";O" +
+                           getOptLevel();
+    objCache = std::make_unique<KaleidoscopeObjectCache>(
+        cacheDir, settings, (uint64_t)cacheSizeMB << 20);
+  }
+  getOptimizationLevel(exprOptLevel); // reject bad -expr-O levels up front
+  theJIT = exitOnError(orc::KaleidoscopeJIT::Create(
+      std::move(JTMB), lazyCompile, std::move(objCache), compileThreads,
+      getCodeGenOptLevel(exprOptLevel)));
 }
 
-void initJIT() { theJIT = std::move(orc::KaleidoscopeJIT::Create().get()); }
+bool backgroundCompile() { return compileThreads && !lazyCompile; }
+
+TargetMachine &initAOTTarget() {
+  auto JTMB = getTargetMachineBuilder();
+  JTMB.setRelocationModel(Reloc::PIC_);
+  theTM = exitOnError(JTMB.createTargetMachine());
+  return *theTM;
+}
 
 Value *LogErrorV(const char *str) {
   LogError(str);
   return nullptr;
 }
 
-Function *getFunction(const std::string &name) {
+Function *getFunction(SymbolID name) {
   // first check if it is already in the module
-  if (auto *F = theModule->getFunction(name))
+  if (auto *F = theModule->getFunction(symbols.getName(name)))
     return F;
 
   // check if we can codegen the decl from existing prototype
-  auto fi = functionProtos.find(name);
-  if (fi != functionProtos.end()) {
-    return fi->second->codegen();
-  }
+  if (auto *proto = functionProtos.lookup(name))
+    return proto->codegen();
 
   // return null if no decl exists
   return nullptr;
 }
 
-AllocaInst *createEntryBlockAllocaInst(Function *theFunc,
-                                       std::string_view varName) {
+// set while the body of an available_externally copy is being emitted
+static bool copyingCallee = false;
+
+// Like getFunction, but for call sites: if the callee was defined in an
+// earlier module, also emit an available_externally copy of its body so the
+// inliner can see it. The JIT still links against the original definition.
+// Only direct callees are copied: calls in a copy's body get declarations,
+// or a chain of definitions would be copied whole into every module.
+Function *getCallee(SymbolID name) {
+  if (auto *F = theModule->getFunction(symbols.getName(name)))
+    return F;
+  Function *f = getFunction(name);
+  // nothing would inline the copy at -O0
+  if (!f || !crossDefInline || moduleOptLevel == '0' || copyingCallee)
+    return f;
+  FunctionAST *def = functionDefs.lookup(name);
+  // a memoized body refers to its cache, which is private to its module
+  if (!def || def->getProto().isMemo())
+    return f;
+
+  // we may be in the middle of emitting the caller; the copy's body opens
+  // its own scope, and only ever names its own arguments and locals
+  IRBuilderBase::InsertPointGuard guard(*Builder);
+  copyingCallee = true;
+  bool copied = def->codegenBody(f);
+  copyingCallee = false;
+  if (copied)
+    f->setLinkage(Function::AvailableExternallyLinkage);
+  else
+    f->deleteBody();
+  return f;
+}
+
+AllocaInst *createEntryBlockAllocaInst(Function *theFunc, StringRef varName,
+                                       Type *type = nullptr) {
   IRBuilder<> tmpBuilder(&theFunc->getEntryBlock(),
                          theFunc->getEntryBlock().begin());
-  return tmpBuilder.CreateAlloca(Type::getDoubleTy(*theContext), nullptr,
-                                 varName);
+  if (!type)
+    type = Type::getDoubleTy(*theContext);
+  return tmpBuilder.CreateAlloca(type, nullptr, varName);
+}
+
+// doubles that convert to an i64 and back without loss, and that can be
+// added without leaving the range where doubles count exactly
+static bool isExactInteger(double x) {
+  return x == std::trunc(x) && std::fabs(x) <= 0x1p53;
+}
+
+//===----------------------------------------------------------------------===//
+// Arrays
+//===----------------------------------------------------------------------===//
+
+// { double *data; int64_t length; }, the KalArray of common.h
+static StructType *getKalArrayType() {
+  return StructType::get(*theContext,
+                         {Builder->getPtrTy(), Builder->getInt64Ty()});
+}
+
+// TBAA tags telling LLVM that storing an element does not change any array's
+// data pointer or length, so loops can load those once and be vectorized.
+static MDNode *getTBAATag(bool element) {
+  MDBuilder md(*theContext);
+  MDNode *root = md.createTBAARoot("Kaleidoscope TBAA");
+  MDNode *type = md.createTBAAScalarTypeNode(
+      element ? "double" : "array descriptor", root);
+  return md.createTBAAStructTagNode(type, type, 0);
+}
+
+static std::optional<ArrayBinding> lookupArray(SymbolID name) {
+  ArrayBinding a = arrayValues.lookup(name);
+  if (a.data)
+    return a;
+  if (!hostArrays.lookup(name))
+    return std::nullopt;
+  // an external KalArray the host binds, declared in each module using it
+  StringRef globalName = symbols.getName(name);
+  GlobalVariable *g = theModule->getNamedGlobal(globalName);
+  if (!g)
+    g = new GlobalVariable(*theModule, getKalArrayType(), false,
+                           GlobalValue::ExternalLinkage, nullptr, globalName);
+  return ArrayBinding{Builder->CreateStructGEP(getKalArrayType(), g, 0),
+                      Builder->CreateStructGEP(getKalArrayType(), g, 1)};
+}
+
+static Value *loadArrayData(const ArrayBinding &a) {
+  LoadInst *data = Builder->CreateLoad(Builder->getPtrTy(), a.data, "data");
+  data->setMetadata(LLVMContext::MD_tbaa, getTBAATag(false));
+  return data;
+}
+
+static Value *loadArrayLength(const ArrayBinding &a) {
+  LoadInst *len = Builder->CreateLoad(Builder->getInt64Ty(), a.length, "len");
+  len->setMetadata(LLVMContext::MD_tbaa, getTBAATag(false));
+  return len;
+}
+
+// Branch to a call of the runtime's kal_index_error unless inBounds holds.
+static void emitBoundsCheck(Value *inBounds, Value *index, Value *length) {
+  Function *theFunc = Builder->GetInsertBlock()->getParent();
+  BasicBlock *failBB = BasicBlock::Create(*theContext, "outofbounds", theFunc);
+  BasicBlock *okBB = BasicBlock::Create(*theContext, "inbounds", theFunc);
+  Builder->CreateCondBr(inBounds, okBB, failBB,
+                        MDBuilder(*theContext).createBranchWeights(1 << 20, 1));
+
+  Builder->SetInsertPoint(failBB);
+  FunctionCallee fail = theModule->getOrInsertFunction(
+      "kal_index_error", Builder->getVoidTy(), Builder->getDoubleTy(),
+      Builder->getInt64Ty());
+  CallInst *call = Builder->CreateCall(fail, {index, length});
+  call->setDoesNotReturn();
+  Builder->CreateUnreachable();
+  Builder->SetInsertPoint(okBB);
+}
+
+// Address of array[index]. An index is valid if 0 <= index < len(array);
+// fractions are truncated.
+static Value *emitElementAddress(SymbolID array, ExprAST *index) {
+  auto a = lookupArray(array);
+  if (!a)
+    return LogErrorV("unknown array name");
+  Type *i64 = Builder->getInt64Ty();
+  Value *intIndex = index->codegenIndex();
+  Value *fpIndex = nullptr;
+  if (!intIndex && !(fpIndex = index->codegen()))
+    return nullptr;
+
+  Value *data = loadArrayData(*a);
+  if (boundsCheck) {
+    Value *len = loadArrayLength(*a);
+    Value *inBounds;
+    if (intIndex) {
+      inBounds = Builder->CreateICmpULT(intIndex, len, "inbounds");
+      fpIndex = Builder->CreateSIToFP(intIndex, Builder->getDoubleTy());
+    } else {
+      Value *fpLen = Builder->CreateSIToFP(len, Builder->getDoubleTy());
+      inBounds = Builder->CreateAnd(
+          Builder->CreateFCmpOGE(fpIndex,
+                                 ConstantFP::get(*theContext, APFloat(0.0))),
+          Builder->CreateFCmpOLT(fpIndex, fpLen), "inbounds");
+    }
+    emitBoundsCheck(inBounds, fpIndex, len);
+  }
+  if (!intIndex)
+    intIndex = Builder->CreateFPToSI(fpIndex, i64, "idx");
+  return Builder->CreateInBoundsGEP(Builder->getDoubleTy(), data, intIndex,
+                                    "elt");
+}
+
+Value *IndexExprAST::codegen() {
+  Value *addr = emitElementAddress(array, index);
+  if (!addr)
+    return nullptr;
+  LoadInst *val = Builder->CreateLoad(Builder->getDoubleTy(), addr, "elt");
+  val->setMetadata(LLVMContext::MD_tbaa, getTBAATag(true));
+  return val;
+}
+
+Value *ArrayStoreExprAST::codegen() {
+  Value *addr = emitElementAddress(array, index);
+  if (!addr)
+    return nullptr;
+  Value *val = value->codegen();
+  if (!val)
+    return nullptr;
+  StoreInst *store = Builder->CreateStore(val, addr);
+  store->setMetadata(LLVMContext::MD_tbaa, getTBAATag(true));
+  return val;
+}
+
+Value *ArrayLenExprAST::codegen() {
+  auto a = lookupArray(array);
+  if (!a)
+    return LogErrorV("unknown array name");
+  return Builder->CreateSIToFP(loadArrayLength(*a), Builder->getDoubleTy(),
+                               "lentmp");
+}
+
+Value *ArrayVarExprAST::codegen() {
+  Value *sizeV = size->codegen();
+  if (!sizeV)
+    return nullptr;
+  // the runtime rejects sizes that are negative, NaN or too large
+  Type *ptrTy = Builder->getPtrTy();
+  FunctionCallee allocFn = theModule->getOrInsertFunction(
+      "kal_array_new", ptrTy, Builder->getDoubleTy());
+  FunctionCallee freeFn = theModule->getOrInsertFunction(
+      "kal_array_delete", Builder->getVoidTy(), ptrTy);
+  Value *data = Builder->CreateCall(allocFn, sizeV, "data");
+  Value *len = Builder->CreateFPToSI(sizeV, Builder->getInt64Ty(), "len");
+
+  Function *theFunc = Builder->GetInsertBlock()->getParent();
+  StringRef varName = symbols.getName(name);
+  AllocaInst *dataSlot = createEntryBlockAllocaInst(theFunc, varName, ptrTy);
+  AllocaInst *lenSlot = createEntryBlockAllocaInst(
+      theFunc, (varName + ".len").str(), Builder->getInt64Ty());
+  Builder->CreateStore(data, dataSlot);
+  Builder->CreateStore(len, lenSlot);
+
+  // the body is never in tail position: the array is freed after it
+  size_t scope = arrayValues.pushScope();
+  arrayValues.bind(name, {dataSlot, lenSlot});
+  Value *bodyVal = body->codegen();
+  arrayValues.popScope(scope);
+  if (!bodyVal)
+    return nullptr;
+  Builder->CreateCall(freeFn, data);
+  return bodyVal;
 }
 
 Value *NumberExprAST::codegen() {
   return ConstantFP::get(*theContext, APFloat(val));
 }
 
+Value *NumberExprAST::codegenIndex() {
+  if (!isExactInteger(val))
+    return nullptr;
+  return Builder->getInt64((int64_t)val);
+}
+
+Value *VariableExprAST::codegenIndex() {
+  // the counter only stands for the variable if it isn't shadowed
+  LoopCounter c = loopCounters.lookup(name);
+  if (!c.var || c.var != namedValues.lookup(name))
+    return nullptr;
+  return c.count;
+}
+
 Value *VariableExprAST::codegen() {
-  AllocaInst *a = namedValues[name];
+  AllocaInst *a = namedValues.lookup(name);
   if (!a)
-    LogErrorV("unknown variable name");
-  return Builder->CreateLoad(a->getAllocatedType(), a, name);
+    return LogErrorV("unknown variable name");
+  return Builder->CreateLoad(a->getAllocatedType(), a, symbols.getName(name));
 }
 
 Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> oldBindings;
+  bool isTail = tailCalls.tailExpr == this;
+  size_t scope = namedValues.pushScope();
   Function *theFunc = Builder->GetInsertBlock()->getParent();
 
   // allocate & initialize all variables
   for (const auto &p : varNames) {
-    const std::string &name = p.first;
-    ExprAST *init = p.second.get();
+    SymbolID name = p.first;
+    ExprAST *init = p.second;
     Value *initVal = nullptr;
     if (init) {
       initVal = init->codegen();
@@ -133,25 +660,20 @@ Value *VarExprAST::codegen() {
     } else {
       initVal = ConstantFP::get(*theContext, APFloat(0.0));
     }
-    AllocaInst *alloca = createEntryBlockAllocaInst(theFunc, name);
+    AllocaInst *alloca =
+        createEntryBlockAllocaInst(theFunc, symbols.getName(name));
     Builder->CreateStore(initVal, alloca);
-    oldBindings.push_back(namedValues[name]);
-    namedValues[name] = alloca;
+    namedValues.bind(name, alloca);
   }
 
   // generate body
+  if (isTail)
+    tailCalls.tailExpr = body;
   Value *bodyVal = body->codegen();
   if (!bodyVal)
     return nullptr;
 
-  // restore all old bindings
-  for (int i = 0; i < varNames.size(); i++) {
-    if (oldBindings[i])
-      namedValues[varNames[i].first] = oldBindings[i];
-    else
-      namedValues.erase(varNames[i].first);
-  }
-
+  namedValues.popScope(scope);
   return bodyVal;
 }
 
@@ -159,21 +681,23 @@ Value *UnaryExprAST::codegen() {
   Value *operandV = operand->codegen();
   if (!operandV)
     return nullptr;
-  Function *f = getFunction(std::string("unary") + op);
+  Function *f = getCallee(operatorSymbol(false, op));
   if (!f)
     return LogErrorV("invalid unary operator");
   return Builder->CreateCall(f, operandV, "unop");
 }
 
+static Value *emitBinaryOp(char op, Value *l, Value *r);
+
 Value *BinaryExprAST::codegen() {
   if (op == '=') { // special case since lhs is not an expression here
-    VariableExprAST *var = static_cast<VariableExprAST *>(lhs.get());
+    VariableExprAST *var = static_cast<VariableExprAST *>(lhs);
     if (!var)
       return LogErrorV("destination of '=' must be a variable");
     Value *val = rhs->codegen();
     if (!val)
       return nullptr;
-    AllocaInst *a = namedValues[var->getName()];
+    AllocaInst *a = namedValues.lookup(var->getName());
     Builder->CreateStore(val, a);
     return val;
   }
@@ -181,6 +705,11 @@ Value *BinaryExprAST::codegen() {
   Value *r = rhs->codegen();
   if (!l || !r)
     return nullptr;
+  return emitBinaryOp(op, l, r);
+}
+
+// l op r, for a built-in or a user-defined operator
+static Value *emitBinaryOp(char op, Value *l, Value *r) {
   switch (op) {
   case '+':
     return Builder->CreateFAdd(l, r, "addtmp");
@@ -198,30 +727,67 @@ Value *BinaryExprAST::codegen() {
     break;
   }
   // user-defined binary operator
-  Function *f = getFunction(std::string("binary") + op);
+  Function *f = getCallee(operatorSymbol(true, op));
   if (!f)
     return LogErrorV("invalid binary operator");
   return Builder->CreateCall(f, {l, r}, "binop");
 }
 
+Value *BinaryExprAST::codegenIndex() {
+  if (op != '+' && op != '-')
+    return nullptr;
+  Value *l = lhs->codegenIndex();
+  if (!l)
+    return nullptr;
+  Value *r = rhs->codegenIndex();
+  if (!r)
+    return nullptr;
+  return op == '+' ? Builder->CreateNSWAdd(l, r, "idxadd")
+                   : Builder->CreateNSWSub(l, r, "idxsub");
+}
+
 Value *CallExprAST::codegen() {
-  Function *calleeF = getFunction(callee);
+  Function *calleeF = getCallee(callee);
   if (!calleeF)
     return LogErrorV("unknown function referenced");
 
-  if (calleeF->arg_size() != args.size())
+  PrototypeAST *proto = functionProtos.lookup(callee);
+  if ((proto ? proto->getArgs().size() : calleeF->arg_size()) != args.size())
     return LogErrorV("incorrect # of arguments passed");
 
+  bool isTail = tailCalls.tailExpr == this && calleeF == tailCalls.func;
   std::vector<Value *> argVs;
-  for (auto &arg : args) {
-    argVs.push_back(arg->codegen());
-    if (!argVs.back())
-      return nullptr;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!proto || !proto->isArrayArg(i)) {
+      argVs.push_back(args[i]->codegen());
+      if (!argVs.back())
+        return nullptr;
+      continue;
+    }
+    // arrays are passed by reference, as their data pointer and length
+    std::optional<SymbolID> name = args[i]->getVariable();
+    auto a = name ? lookupArray(*name) : std::nullopt;
+    if (!a)
+      return LogErrorV("expected an array name as argument");
+    argVs.push_back(loadArrayData(*a));
+    argVs.push_back(loadArrayLength(*a));
   }
-  return Builder->CreateCall(calleeF, argVs, "calltmp");
+  if (Value *v = emitMathCall(callee, argVs))
+    return v;
+  if (!isTail)
+    return Builder->CreateCall(calleeF, argVs, "calltmp");
+
+  // all arguments are evaluated before any parameter is overwritten
+  for (size_t i = 0; i < argVs.size(); i++)
+    Builder->CreateStore(argVs[i], tailCalls.params[i]);
+  Builder->CreateBr(tailCalls.header);
+  // never used: the block is terminated, which tells the caller (an if, var or
+  // function body) not to branch to its own continuation
+  return PoisonValue::get(Type::getDoubleTy(*theContext));
 }
 
 Value *IfExprAST::codegen() {
+  bool isTail = tailCalls.tailExpr == this;
   Value *condV = cond->codegen();
   if (!condV)
     return nullptr;
@@ -238,33 +804,58 @@ Value *IfExprAST::codegen() {
   // emit then node
   theFunc->insert(theFunc->end(), thenBB);
   Builder->SetInsertPoint(thenBB);
+  if (isTail)
+    tailCalls.tailExpr = then_;
   Value *thenV = then_->codegen();
   if (!thenV)
     return nullptr;
-  Builder->CreateBr(mergeBB);
   thenBB = Builder->GetInsertBlock(); // get end of then block
+  // a branch that ended in a tail call has jumped away already
+  bool thenFalls = !thenBB->getTerminator();
+  if (thenFalls)
+    Builder->CreateBr(mergeBB);
 
   // emit else node
   theFunc->insert(theFunc->end(), elseBB);
   Builder->SetInsertPoint(elseBB);
+  if (isTail)
+    tailCalls.tailExpr = else_;
   Value *elseV = else_->codegen();
   if (!elseV)
     return nullptr;
-  Builder->CreateBr(mergeBB);
   elseBB = Builder->GetInsertBlock(); // get end of else block
+  bool elseFalls = !elseBB->getTerminator();
+  if (elseFalls)
+    Builder->CreateBr(mergeBB);
 
   // emit merge node
   theFunc->insert(theFunc->end(), mergeBB);
   Builder->SetInsertPoint(mergeBB);
+  if (!thenFalls && !elseFalls) // unreachable; the caller's ret goes unused
+    return PoisonValue::get(Type::getDoubleTy(*theContext));
   PHINode *pn = Builder->CreatePHI(Type::getDoubleTy(*theContext), 2, "iftmp");
-  pn->addIncoming(thenV, thenBB);
-  pn->addIncoming(elseV, elseBB);
+  if (thenFalls)
+    pn->addIncoming(thenV, thenBB);
+  if (elseFalls)
+    pn->addIncoming(elseV, elseBB);
   return pn;
 }
 
 Value *ForExprAST::codegen() {
+  // count with an i64 when the variable steps through integers up to a
+  // bound: LLVM can compute a trip count for that (and vectorize the loop),
+  // but not for a double compared against a double
+  if (bound && !body->assigns(varName) && !bound->assigns(varName)) {
+    auto startVal = start->fold();
+    auto stepVal = step ? step->fold() : std::optional<double>(1.0);
+    if (startVal && stepVal && isExactInteger(*startVal) &&
+        isExactInteger(*stepVal) && *stepVal >= 1)
+      return codegenCounted(*startVal, *stepVal);
+  }
+
   Function *theFunc = Builder->GetInsertBlock()->getParent();
-  AllocaInst *alloca = createEntryBlockAllocaInst(theFunc, varName);
+  AllocaInst *alloca =
+      createEntryBlockAllocaInst(theFunc, symbols.getName(varName));
   Value *startV = start->codegen();
   if (!startV)
     return nullptr;
@@ -274,10 +865,9 @@ Value *ForExprAST::codegen() {
   Builder->CreateStore(startV, alloca);
   Builder->CreateBr(loopBB); // implicit fall through from pre to loop
 
-  // if the loop variable is defined before, create a new one
-  // and restore it after the loop
-  AllocaInst *oldAlloca = namedValues[varName];
-  namedValues[varName] = alloca;
+  // the loop variable shadows any outer binding until the loop ends
+  size_t scope = namedValues.pushScope();
+  namedValues.bind(varName, alloca);
 
   // generate body in loopBB
   theFunc->insert(theFunc->end(), loopBB);
@@ -295,7 +885,7 @@ Value *ForExprAST::codegen() {
     stepVal = ConstantFP::get(*theContext, APFloat(1.0));
   }
   Value *curVal =
-      Builder->CreateLoad(alloca->getAllocatedType(), alloca, varName);
+      Builder->CreateLoad(alloca->getAllocatedType(), alloca, symbols.getName(varName));
   Value *nextVal = Builder->CreateFAdd(curVal, stepVal, "nextvar");
   Builder->CreateStore(nextVal, alloca);
 
@@ -312,55 +902,519 @@ Value *ForExprAST::codegen() {
   // any new code will be inserted in afterBB
   Builder->SetInsertPoint(afterBB);
 
-  // restore old value
-  if (oldAlloca)
-    namedValues[varName] = oldAlloca;
-  else
-    namedValues.erase(varName);
+  namedValues.popScope(scope);
 
   return ConstantFP::getNullValue(Type::getDoubleTy(*theContext));
 }
 
+// The i64 limit of a counter compared against bound: count < bound for an
+// integer count is count < ceil(bound). Clamping to +-2^53 maps a NaN bound
+// (for which `<` is true) to the largest counter.
+static Value *emitCountLimit(Value *boundV) {
+  Type *doubleTy = Builder->getDoubleTy();
+  Value *limit = Builder->CreateUnaryIntrinsic(Intrinsic::ceil, boundV);
+  limit = Builder->CreateMinNum(limit, ConstantFP::get(doubleTy, 0x1p53));
+  limit = Builder->CreateMaxNum(limit, ConstantFP::get(doubleTy, -0x1p53));
+  return Builder->CreateFPToSI(limit, Builder->getInt64Ty(), "limit");
+}
+
+// The same loop as codegen, with the variable's value kept in an i64 counter
+// as well. Both are exact: the variable is an integer below 2^53 in
+// magnitude and is not assigned to in the loop. The bound is still evaluated
+// after every increment.
+Value *ForExprAST::codegenCounted(double startVal, double stepVal) {
+  Function *theFunc = Builder->GetInsertBlock()->getParent();
+  StringRef name = symbols.getName(varName);
+  Type *i64 = Builder->getInt64Ty();
+  Type *doubleTy = Builder->getDoubleTy();
+  AllocaInst *alloca = createEntryBlockAllocaInst(theFunc, name);
+  AllocaInst *counter =
+      createEntryBlockAllocaInst(theFunc, (name + ".count").str(), i64);
+  Builder->CreateStore(ConstantInt::get(i64, (int64_t)startVal), counter);
+  BasicBlock *loopBB = BasicBlock::Create(*theContext, "loop", theFunc);
+  Builder->CreateBr(loopBB);
+  Builder->SetInsertPoint(loopBB);
+
+  Value *count = Builder->CreateLoad(i64, counter, "count");
+  Builder->CreateStore(Builder->CreateSIToFP(count, doubleTy, name), alloca);
+  size_t scope = namedValues.pushScope();
+  size_t counterScope = loopCounters.pushScope();
+  namedValues.bind(varName, alloca);
+  loopCounters.bind(varName, {alloca, count});
+  if (!body->codegen())
+    return nullptr;
+  loopCounters.popScope(counterScope);
+
+  Value *next = Builder->CreateNSWAdd(
+      count, ConstantInt::get(i64, (int64_t)stepVal), "nextcount");
+  Builder->CreateStore(next, counter);
+  Builder->CreateStore(Builder->CreateSIToFP(next, doubleTy, "nextvar"),
+                       alloca);
+
+  Value *boundV = bound->codegen();
+  if (!boundV)
+    return nullptr;
+  Value *limit = emitCountLimit(boundV);
+  Value *endCond = Builder->CreateICmpSLT(next, limit, "loopcond");
+  BasicBlock *afterBB = BasicBlock::Create(*theContext, "afterloop", theFunc);
+  Builder->CreateCondBr(endCond, loopBB, afterBB);
+  Builder->SetInsertPoint(afterBB);
+
+  namedValues.popScope(scope);
+
+  return ConstantFP::getNullValue(doubleTy);
+}
+
+//===----------------------------------------------------------------------===//
+// parfor
+//===----------------------------------------------------------------------===//
+//
+// The body goes into an internal function `void f.parfor(ptr env, i64 chunk)`
+// that runs one chunk of consecutive iterations, and the loop itself becomes a
+// call of the runtime's kal_parfor, which runs every chunk on its thread pool.
+// env holds the values of the enclosing function's variables and arrays, the
+// trip count and chunk size, and with reduce, where each chunk leaves its
+// partial result. The caller combines those in order once all have finished.
+
+// most chunks a loop is split into, whatever the number of threads
+static const int64_t parforMaxChunks = 1024;
+
+// Fast-math attributes of the enclosing function, which the outlined body
+// shares.
+static void copyFastMathAttrs(Function *from, Function *to) {
+  for (const Attribute &attr : from->getAttributes().getFnAttrs())
+    if (attr.isStringAttribute() && attr.getKindAsString().endswith("-fp-math"))
+      to->addFnAttr(attr);
+}
+
+Value *ParforExprAST::codegen() {
+  auto startVal = start->fold();
+  auto stepVal = step ? step->fold() : std::optional<double>(1.0);
+  if (!startVal || !stepVal || !isExactInteger(*startVal) ||
+      !isExactInteger(*stepVal) || *stepVal < 1)
+    return LogErrorV("parfor needs constant integer start and step values, "
+                     "with a step of at least 1");
+  if (body->assigns(varName))
+    return LogErrorV("parfor body cannot assign to its loop variable");
+  // memo caches are plain globals: concurrent calls could read an entry
+  // another thread is overwriting
+  bool reachesMemo = false;
+  body->forEachCallee([&](SymbolID callee) {
+    if (PrototypeAST *proto = functionProtos.lookup(callee))
+      reachesMemo |= proto->isMemo() || proto->isMemoCaller();
+  });
+  if (reachesMemo)
+    return LogErrorV("parfor body cannot call memoized functions, directly or "
+                     "not: their caches are not thread-safe");
+
+  Function *theFunc = Builder->GetInsertBlock()->getParent();
+  Type *i64 = Builder->getInt64Ty();
+  Type *doubleTy = Builder->getDoubleTy();
+  Type *ptrTy = Builder->getPtrTy();
+
+  // what the body can see of the enclosing function, passed by value; other
+  // bindings belong to a function whose body getCallee interrupted
+  SmallVector<std::pair<SymbolID, AllocaInst *>, 8> vars;
+  namedValues.forEachBinding([&](SymbolID name, AllocaInst *a) {
+    if (a && a->getFunction() == theFunc && name != varName)
+      vars.emplace_back(name, a);
+  });
+  for (auto &var : vars)
+    if (body->assigns(var.first))
+      return LogErrorV("parfor body cannot assign to variables outside it, "
+                       "its iterations run in parallel");
+  SmallVector<std::pair<SymbolID, ArrayBinding>, 4> arrays;
+  arrayValues.forEachBinding([&](SymbolID name, ArrayBinding a) {
+    if (a.data && name != varName)
+      arrays.emplace_back(name, a);
+  });
+
+  // env: the variables, (data, length) of the arrays, then the partial
+  // results, the chunk size and the trip count
+  SmallVector<Type *, 16> fields(vars.size(), doubleTy);
+  for (size_t i = 0; i < arrays.size(); i++) {
+    fields.push_back(ptrTy);
+    fields.push_back(i64);
+  }
+  unsigned partialsField = fields.size();
+  fields.append({ptrTy, i64, i64});
+  StructType *envTy = StructType::get(*theContext, fields);
+
+  // the trip count and chunks, in the enclosing function
+  Value *boundV = bound->codegen();
+  if (!boundV)
+    return nullptr;
+  // ceil(a / b) for a >= 0, b > 0
+  auto divideUp = [](Value *a, Value *b, const Twine &name) {
+    Value *bMinus1 = Builder->CreateNSWSub(b, Builder->getInt64(1));
+    return Builder->CreateSDiv(Builder->CreateNSWAdd(a, bMinus1), b, name);
+  };
+  Value *first = ConstantInt::get(i64, (int64_t)*startVal);
+  Value *stride = ConstantInt::get(i64, (int64_t)*stepVal);
+  Value *span = Builder->CreateNSWSub(emitCountLimit(boundV), first);
+  Value *count = Builder->CreateSelect(
+      Builder->CreateICmpSGT(span, Builder->getInt64(0)),
+      divideUp(span, stride, "iters"), Builder->getInt64(0), "count");
+  Value *chunkSize = Builder->CreateBinaryIntrinsic(
+      Intrinsic::smax, Builder->getInt64(1),
+      divideUp(count, Builder->getInt64(parforMaxChunks), ""), nullptr,
+      "chunksize");
+  Value *numChunks = divideUp(count, chunkSize, "chunks");
+
+  AllocaInst *env = createEntryBlockAllocaInst(theFunc, "parfor.env", envTy);
+  unsigned field = 0;
+  for (auto &var : vars)
+    Builder->CreateStore(
+        Builder->CreateLoad(doubleTy, var.second, symbols.getName(var.first)),
+        Builder->CreateStructGEP(envTy, env, field++));
+  for (auto &array : arrays) {
+    Builder->CreateStore(loadArrayData(array.second),
+                         Builder->CreateStructGEP(envTy, env, field++));
+    Builder->CreateStore(loadArrayLength(array.second),
+                         Builder->CreateStructGEP(envTy, env, field++));
+  }
+  ArrayType *partialsTy = ArrayType::get(doubleTy, parforMaxChunks);
+  AllocaInst *partials = nullptr;
+  if (reduceOp)
+    partials = createEntryBlockAllocaInst(theFunc, "parfor.partials",
+                                          partialsTy);
+  Builder->CreateStore(partials ? (Value *)partials
+                                : ConstantPointerNull::get(
+                                      PointerType::getUnqual(*theContext)),
+                       Builder->CreateStructGEP(envTy, env, partialsField));
+  Builder->CreateStore(chunkSize,
+                       Builder->CreateStructGEP(envTy, env, partialsField + 1));
+  Builder->CreateStore(count,
+                       Builder->CreateStructGEP(envTy, env, partialsField + 2));
+
+  // the chunk function
+  Function *chunkFunc = Function::Create(
+      FunctionType::get(Builder->getVoidTy(), {ptrTy, i64}, false),
+      Function::InternalLinkage, theFunc->getName() + ".parfor",
+      theModule.get());
+  copyFastMathAttrs(theFunc, chunkFunc);
+  {
+    IRBuilderBase::InsertPointGuard guard(*Builder);
+    // like a function body of its own; see FunctionAST::codegenBody
+    TailCallState outerTailCalls = std::move(tailCalls);
+    tailCalls = TailCallState();
+    tailCalls.func = chunkFunc;
+    ScopedBindings<ArrayBinding> outerArrays = std::move(arrayValues);
+    arrayValues = ScopedBindings<ArrayBinding>();
+    size_t scope = namedValues.pushScope();
+    size_t counterScope = loopCounters.pushScope();
+
+    Value *chunkEnv = chunkFunc->getArg(0);
+    Value *chunk = chunkFunc->getArg(1);
+    chunkEnv->setName("env");
+    chunk->setName("chunk");
+    Builder->SetInsertPoint(
+        BasicBlock::Create(*theContext, "entry", chunkFunc));
+    field = 0;
+    for (auto &var : vars) {
+      StringRef name = symbols.getName(var.first);
+      AllocaInst *alloca = createEntryBlockAllocaInst(chunkFunc, name);
+      Value *slot = Builder->CreateStructGEP(envTy, chunkEnv, field++);
+      Builder->CreateStore(Builder->CreateLoad(doubleTy, slot, name), alloca);
+      namedValues.bind(var.first, alloca);
+    }
+    for (auto &array : arrays) {
+      StringRef name = symbols.getName(array.first);
+      ArrayBinding binding;
+      for (Value **slot : {&binding.data, &binding.length}) {
+        Type *type = slot == &binding.data ? ptrTy : i64;
+        AllocaInst *alloca = createEntryBlockAllocaInst(chunkFunc, name, type);
+        Value *src = Builder->CreateStructGEP(envTy, chunkEnv, field++);
+        Builder->CreateStore(Builder->CreateLoad(type, src), alloca);
+        *slot = alloca;
+      }
+      arrayValues.bind(array.first, binding);
+    }
+    Value *chunkSizeV = Builder->CreateLoad(
+        i64, Builder->CreateStructGEP(envTy, chunkEnv, partialsField + 1),
+        "chunksize");
+    Value *countV = Builder->CreateLoad(
+        i64, Builder->CreateStructGEP(envTy, chunkEnv, partialsField + 2),
+        "count");
+    Value *begin = Builder->CreateNSWMul(chunk, chunkSizeV, "begin");
+    Value *end = Builder->CreateBinaryIntrinsic(
+        Intrinsic::smin, Builder->CreateNSWAdd(begin, chunkSizeV), countV,
+        nullptr, "end");
+
+    // the iterations of the chunk, counted like ForExprAST::codegenCounted
+    StringRef name = symbols.getName(varName);
+    AllocaInst *varAlloca = createEntryBlockAllocaInst(chunkFunc, name);
+    AllocaInst *counter =
+        createEntryBlockAllocaInst(chunkFunc, (name + ".iter").str(), i64);
+    AllocaInst *partial =
+        reduceOp ? createEntryBlockAllocaInst(chunkFunc, "partial") : nullptr;
+    Builder->CreateStore(begin, counter);
+    BasicBlock *loopBB = BasicBlock::Create(*theContext, "loop", chunkFunc);
+    Builder->CreateBr(loopBB);
+    Builder->SetInsertPoint(loopBB);
+    Value *iter = Builder->CreateLoad(i64, counter, "iter");
+    Value *varCount = Builder->CreateNSWAdd(
+        first, Builder->CreateNSWMul(iter, stride), (name + ".count").str());
+    Builder->CreateStore(Builder->CreateSIToFP(varCount, doubleTy, name),
+                         varAlloca);
+    namedValues.bind(varName, varAlloca);
+    loopCounters.bind(varName, {varAlloca, varCount});
+    Value *val = body->codegen();
+    bool ok = val != nullptr;
+    if (ok && reduceOp) {
+      // the chunk's first value starts its partial result
+      BasicBlock *combineBB =
+          BasicBlock::Create(*theContext, "combine", chunkFunc);
+      BasicBlock *nextBB = BasicBlock::Create(*theContext, "next", chunkFunc);
+      BasicBlock *firstBB = Builder->GetInsertBlock();
+      Builder->CreateCondBr(Builder->CreateICmpEQ(iter, begin), nextBB,
+                            combineBB);
+      Builder->SetInsertPoint(combineBB);
+      Value *combined = emitBinaryOp(
+          reduceOp, Builder->CreateLoad(doubleTy, partial, "partial"), val);
+      ok = combined != nullptr;
+      if (ok) {
+        combineBB = Builder->GetInsertBlock();
+        Builder->CreateBr(nextBB);
+        Builder->SetInsertPoint(nextBB);
+        PHINode *pn = Builder->CreatePHI(doubleTy, 2, "partial");
+        pn->addIncoming(val, firstBB);
+        pn->addIncoming(combined, combineBB);
+        Builder->CreateStore(pn, partial);
+      }
+    }
+    if (ok) {
+      Value *next =
+          Builder->CreateNSWAdd(iter, Builder->getInt64(1), "nextiter");
+      Builder->CreateStore(next, counter);
+      BasicBlock *exitBB = BasicBlock::Create(*theContext, "exit", chunkFunc);
+      Builder->CreateCondBr(Builder->CreateICmpSLT(next, end, "loopcond"),
+                            loopBB, exitBB);
+      Builder->SetInsertPoint(exitBB);
+      if (reduceOp) {
+        Value *slots = Builder->CreateLoad(
+            ptrTy, Builder->CreateStructGEP(envTy, chunkEnv, partialsField),
+            "partials");
+        Builder->CreateStore(
+            Builder->CreateLoad(doubleTy, partial, "partial"),
+            Builder->CreateInBoundsGEP(doubleTy, slots, chunk));
+      }
+      Builder->CreateRetVoid();
+      verifyFunction(*chunkFunc);
+    }
+
+    loopCounters.popScope(counterScope);
+    namedValues.popScope(scope);
+    tailCalls = std::move(outerTailCalls);
+    arrayValues = std::move(outerArrays);
+    if (!ok) {
+      chunkFunc->eraseFromParent();
+      return nullptr;
+    }
+  }
+
+  FunctionCallee parfor = theModule->getOrInsertFunction(
+      "kal_parfor", Builder->getVoidTy(), ptrTy, ptrTy, i64);
+  Builder->CreateCall(parfor, {chunkFunc, env, numChunks});
+  if (!reduceOp)
+    return ConstantFP::getNullValue(doubleTy);
+
+  // combine the chunks' results in order; no iterations make 0
+  AllocaInst *result = createEntryBlockAllocaInst(theFunc, "parfor.result");
+  Builder->CreateStore(ConstantFP::getNullValue(doubleTy), result);
+  BasicBlock *combineBB = BasicBlock::Create(*theContext, "reduce", theFunc);
+  BasicBlock *afterBB = BasicBlock::Create(*theContext, "afterparfor", theFunc);
+  AllocaInst *index =
+      createEntryBlockAllocaInst(theFunc, "parfor.chunk", i64);
+  Builder->CreateStore(Builder->getInt64(0), index);
+  Builder->CreateCondBr(Builder->CreateICmpSGT(numChunks, Builder->getInt64(0)),
+                        combineBB, afterBB);
+  Builder->SetInsertPoint(combineBB);
+  Value *c = Builder->CreateLoad(i64, index, "chunk");
+  Value *partialV = Builder->CreateLoad(
+      doubleTy, Builder->CreateInBoundsGEP(partialsTy, partials,
+                                           {Builder->getInt64(0), c}),
+      "partial");
+  BasicBlock *firstBB = Builder->GetInsertBlock();
+  BasicBlock *foldBB = BasicBlock::Create(*theContext, "reduceop", theFunc);
+  BasicBlock *nextBB = BasicBlock::Create(*theContext, "reducenext", theFunc);
+  Builder->CreateCondBr(Builder->CreateICmpEQ(c, Builder->getInt64(0)), nextBB,
+                        foldBB);
+  Builder->SetInsertPoint(foldBB);
+  Value *combined = emitBinaryOp(
+      reduceOp, Builder->CreateLoad(doubleTy, result, "acc"), partialV);
+  if (!combined)
+    return nullptr;
+  foldBB = Builder->GetInsertBlock();
+  Builder->CreateBr(nextBB);
+  Builder->SetInsertPoint(nextBB);
+  PHINode *acc = Builder->CreatePHI(doubleTy, 2, "acc");
+  acc->addIncoming(partialV, firstBB);
+  acc->addIncoming(combined, foldBB);
+  Builder->CreateStore(acc, result);
+  Value *nextC = Builder->CreateNSWAdd(c, Builder->getInt64(1), "nextchunk");
+  Builder->CreateStore(nextC, index);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(nextC, numChunks), combineBB,
+                        afterBB);
+  Builder->SetInsertPoint(afterBB);
+  return Builder->CreateLoad(doubleTy, result, "reduced");
+}
+
 Function *PrototypeAST::codegen() {
-  std::vector<Type *> doubles(args.size(), Type::getDoubleTy(*theContext));
+  std::vector<Type *> params;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (isArrayArg(i)) {
+      params.push_back(PointerType::getUnqual(*theContext));
+      params.push_back(Type::getInt64Ty(*theContext));
+    } else {
+      params.push_back(Type::getDoubleTy(*theContext));
+    }
+  }
   FunctionType *ft =
-      FunctionType::get(Type::getDoubleTy(*theContext), doubles, false);
-  Function *f =
-      Function::Create(ft, Function::ExternalLinkage, name, theModule.get());
-  unsigned idx = 0;
-  for (auto &arg : f->args())
-    arg.setName(args[idx++]);
+      FunctionType::get(Type::getDoubleTy(*theContext), params, false);
+  Function *f = Function::Create(ft, Function::ExternalLinkage, getName(),
+                                 theModule.get());
+  auto arg = f->arg_begin();
+  for (size_t i = 0; i < args.size(); i++) {
+    StringRef name = symbols.getName(args[i]);
+    (arg++)->setName(name);
+    if (isArrayArg(i))
+      (arg++)->setName(name + ".len");
+  }
+  if (isSimd())
+    declareSimdVariants(f);
   return f;
 }
 
-Function *FunctionAST::codegen() {
-  auto &p = *proto;
-  functionProtos[p.getName()] = std::move(proto);
-  Function *theFunc = getFunction(p.getName());
-  if (!theFunc)
-    return nullptr;
-  if (!theFunc->empty())
-    return (Function *)LogErrorV("function cannot be redefined");
-  if (p.isBinaryOp()) // if this is a binary operator, install it
-    binOpPrecedence[p.getOperatorName()] = p.getBinaryPrecedence();
+bool FunctionAST::codegenBody(Function *theFunc) {
+  IRBuilderBase::FastMathFlagGuard fmfGuard(*Builder);
+  if (fastMath || proto->isFastMath()) {
+    FastMathFlags fmf;
+    fmf.setFast();
+    Builder->setFastMathFlags(fmf);
+    // the attributes clang sets for -ffast-math, for the backend's benefit
+    for (const char *attr :
+         {"unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math",
+          "no-signed-zeros-fp-math", "approx-func-fp-math"})
+      theFunc->addFnAttr(attr, "true");
+  }
 
   BasicBlock *bb = BasicBlock::Create(*theContext, "entry", theFunc);
   Builder->SetInsertPoint(bb);
 
-  namedValues.clear();
-  for (auto &arg : theFunc->args()) {
-    AllocaInst *alloca = createEntryBlockAllocaInst(theFunc, arg.getName());
-    Builder->CreateStore(&arg, alloca);
-    namedValues[arg.getName().str()] = alloca;
+  // getCallee may emit another body while this one is half done
+  TailCallState outerTailCalls = std::move(tailCalls);
+  tailCalls = TailCallState();
+  tailCalls.func = theFunc;
+
+  // nor may the arrays of the function being emitted leak into this one
+  ScopedBindings<ArrayBinding> outerArrays = std::move(arrayValues);
+  arrayValues = ScopedBindings<ArrayBinding>();
+
+  // a body that fails may leave its scopes open; they end with it
+  size_t scope = namedValues.pushScope();
+  size_t counterScope = loopCounters.pushScope();
+  auto arg = theFunc->arg_begin();
+  for (size_t i = 0; i < proto->getArgs().size(); i++) {
+    SymbolID name = proto->getArgs()[i];
+    if (!proto->isArrayArg(i)) {
+      AllocaInst *alloca = createEntryBlockAllocaInst(theFunc, arg->getName());
+      Builder->CreateStore(&*arg++, alloca);
+      namedValues.bind(name, alloca);
+      tailCalls.params.push_back(alloca);
+      continue;
+    }
+    ArrayBinding binding;
+    for (Value **slot : {&binding.data, &binding.length}) {
+      AllocaInst *alloca = createEntryBlockAllocaInst(
+          theFunc, arg->getName(), arg->getType());
+      Builder->CreateStore(&*arg++, alloca);
+      tailCalls.params.push_back(alloca);
+      *slot = alloca;
+    }
+    arrayValues.bind(name, binding);
   }
+  // hits return here; tail calls jump past the lookup, and the result is
+  // cached under the arguments of the original call
+  Value *memoEntry = proto->isMemo() ? emitMemoLookup(theFunc) : nullptr;
+  // SimplifyCFG folds this block back into the entry if nothing jumps here
+  tailCalls.header = BasicBlock::Create(*theContext, "tailrecurse", theFunc);
+  Builder->CreateBr(tailCalls.header);
+  Builder->SetInsertPoint(tailCalls.header);
 
-  if (Value *retVal = body->codegen()) {
+  tailCalls.tailExpr = body;
+  Value *retVal = body->codegen();
+  namedValues.popScope(scope);
+  loopCounters.popScope(counterScope);
+  tailCalls = std::move(outerTailCalls);
+  arrayValues = std::move(outerArrays);
+  if (!retVal)
+    return false;
+  if (!Builder->GetInsertBlock()->getTerminator()) {
+    if (memoEntry)
+      emitMemoStore(theFunc, memoEntry, retVal);
     Builder->CreateRet(retVal);
-    verifyFunction(*theFunc);
-    theFPM->run(*theFunc, *theFAM);
-    return theFunc;
-  } else {
-    theFunc->eraseFromParent();
+  }
+  verifyFunction(*theFunc);
+  return true;
+}
+
+Function *FunctionAST::codegen() {
+  PhaseTimer timer(Phase::codegen);
+  auto &p = *proto;
+  functionProtos[p.getNameID()] = proto;
+  Function *theFunc = getFunction(p.getNameID());
+  if (!theFunc)
     return nullptr;
+  if (!theFunc->empty())
+    return (Function *)LogErrorV("function cannot be redefined");
+  installBinaryOperator(p);
+
+  if (prepareMemo(*this) && codegenBody(theFunc)) {
+    if (prepareSimd(*this, vectorizesAt(moduleOptLevel)))
+      emitSimdVariants(*this, theFunc);
+    stats::counters.functions++;
+    return theFunc;
   }
+  theFunc->eraseFromParent();
+  return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// ExprAST::assigns
+//===----------------------------------------------------------------------===//
+
+bool VarExprAST::assigns(SymbolID var) const {
+  for (const auto &p : varNames)
+    if (p.second && p.second->assigns(var))
+      return true;
+  return body->assigns(var);
+}
+
+bool UnaryExprAST::assigns(SymbolID var) const {
+  return operand->assigns(var);
+}
+
+bool BinaryExprAST::assigns(SymbolID var) const {
+  if (op == '=' && lhs->getVariable() == var)
+    return true;
+  return lhs->assigns(var) || rhs->assigns(var);
+}
+
+bool CallExprAST::assigns(SymbolID var) const {
+  return any_of(args, [&](ExprAST *arg) { return arg->assigns(var); });
+}
+
+bool IfExprAST::assigns(SymbolID var) const {
+  return cond->assigns(var) || then_->assigns(var) || else_->assigns(var);
+}
+
+bool ForExprAST::assigns(SymbolID var) const {
+  return start->assigns(var) || end->assigns(var) ||
+         (step && step->assigns(var)) || body->assigns(var);
+}
+
+bool ParforExprAST::assigns(SymbolID var) const {
+  return start->assigns(var) || bound->assigns(var) ||
+         (step && step->assigns(var)) || body->assigns(var);
 }
@@ -1,7 +1,18 @@
 #pragma once
 
-#include <map>
-
 #include "ast.h"
 
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
\ No newline at end of file
+extern SymbolMap<PrototypeAST *> functionProtos;
+// definitions already handed to the JIT, kept so later modules can inline them
+extern SymbolMap<FunctionAST *> functionDefs;
+// declarations of arrays the host provides (`extern name[]`)
+extern SymbolMap<PrototypeAST *> hostArrays;
+
+// Declare name in the current module for a call. A definition from an
+// earlier module also gets an available_externally copy of its body, so the
+// call can be inlined.
+Function *getCallee(SymbolID name);
+
+// Symbol of the function implementing a user-defined operator
+// ("binary<op>" or "unary<op>"), interned on first use.
+SymbolID operatorSymbol(bool binary, char op);
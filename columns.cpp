@@ -0,0 +1,86 @@
+#include "codegen.h"
+#include "common.h"
+
+#include <string>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/Verifier.h"
+
+// wrappers already compiled, by function name
+static StringMap<ColumnFunction> columnFunctions;
+
+// Emit `void loopName(ptr cols, ptr out, i64 rows)` calling f once per row.
+static void emitColumnLoop(Function *f, StringRef loopName) {
+  Type *ptrTy = Builder->getPtrTy();
+  Type *i64 = Builder->getInt64Ty();
+  Type *doubleTy = Builder->getDoubleTy();
+  FunctionType *ft =
+      FunctionType::get(Builder->getVoidTy(), {ptrTy, ptrTy, i64}, false);
+  Function *loop = Function::Create(ft, Function::ExternalLinkage, loopName,
+                                    theModule.get());
+  Value *cols = loop->getArg(0), *out = loop->getArg(1),
+        *rows = loop->getArg(2);
+  cols->setName("cols");
+  out->setName("out");
+  rows->setName("rows");
+
+  BasicBlock *entryBB = BasicBlock::Create(*theContext, "entry", loop);
+  BasicBlock *loopBB = BasicBlock::Create(*theContext, "loop", loop);
+  BasicBlock *exitBB = BasicBlock::Create(*theContext, "exit", loop);
+  Builder->SetInsertPoint(entryBB);
+  SmallVector<Value *, 8> columns;
+  for (unsigned i = 0; i < f->arg_size(); i++)
+    columns.push_back(Builder->CreateLoad(
+        ptrTy, Builder->CreateConstInBoundsGEP1_64(ptrTy, cols, i), "col"));
+  Builder->CreateCondBr(Builder->CreateICmpSGT(rows, Builder->getInt64(0)),
+                        loopBB, exitBB);
+
+  Builder->SetInsertPoint(loopBB);
+  PHINode *row = Builder->CreatePHI(i64, 2, "row");
+  row->addIncoming(Builder->getInt64(0), entryBB);
+  SmallVector<Value *, 8> args;
+  for (Value *col : columns)
+    args.push_back(Builder->CreateLoad(
+        doubleTy, Builder->CreateInBoundsGEP(doubleTy, col, row), "arg"));
+  Value *val = Builder->CreateCall(f, args, "val");
+  Builder->CreateStore(val, Builder->CreateInBoundsGEP(doubleTy, out, row));
+  Value *next = Builder->CreateNSWAdd(row, Builder->getInt64(1), "nextrow");
+  row->addIncoming(next, loopBB);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(next, rows), loopBB, exitBB);
+
+  Builder->SetInsertPoint(exitBB);
+  Builder->CreateRetVoid();
+  verifyFunction(*loop);
+}
+
+Expected<ColumnFunction> getColumnFunction(StringRef name) {
+  if (ColumnFunction fn = columnFunctions.lookup(name))
+    return fn;
+  SymbolID sym = symbols.intern(name);
+  PrototypeAST *proto = functionProtos.lookup(sym);
+  if (!proto)
+    return createStringError(inconvertibleErrorCode(),
+                             "unknown function %s", name.str().c_str());
+  if (proto->hasArrayArgs())
+    return createStringError(inconvertibleErrorCode(),
+                             "%s takes arrays, not one number per column",
+                             name.str().c_str());
+
+  // getCallee brings in a copy of the body for the inliner
+  std::string loopName = (name + ".columns").str();
+  emitColumnLoop(getCallee(sym), loopName);
+  optimizeModule();
+  showIR("column function", *theModule->getFunction(loopName));
+  if (auto err = theJIT->addModule(
+          orc::ThreadSafeModule(std::move(theModule), std::move(theContext))))
+    return std::move(err);
+  initModuleAndPassMgr();
+
+  auto loopSym = theJIT->lookup(loopName);
+  if (!loopSym)
+    return loopSym.takeError();
+  auto fn = loopSym->getAddress().toPtr<ColumnFunction>();
+  columnFunctions[name] = fn;
+  return fn;
+}
@@ -2,17 +2,31 @@
 
 #include "jit.h"
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Target/TargetMachine.h"
 
 using namespace llvm;
 
+// How much the driver reports on stderr, selected with -v. Each level
+// includes the ones before it.
+enum class Verbosity {
+  quiet,  // results only
+  info,   // progress messages and statistics
+  ir,     // plus the IR of every function as it is compiled
+  passes, // plus each pass as it runs and the IR after it
+};
+extern Verbosity verbosity;
+
 #ifdef DEBUG
 inline void LogDebug(const char *fmt, ...) {
   va_list args;
@@ -25,6 +39,8 @@ inline void LogDebug(const char *fmt, ...) {}
 #endif
 
 inline void LogInfo(const char *fmt, ...) {
+  if (verbosity < Verbosity::info)
+    return;
   va_list args;
   va_start(args, fmt);
   vfprintf(stderr, fmt, args);
@@ -46,5 +62,59 @@ inline const char *ANON_EXPR_NAME = "__anon_expr";
 
 // interfaces
 void initModuleAndPassMgr();
+// The current, still empty module will hold a top-level expression that runs
+// once: optimize it at the cheaper -expr-O level instead of -O.
+void initExprModule();
+void optimizeModule();
+// override the -O level for modules created from now on ('0'-'3', 's', 'z'):
+// both their IR pipeline and the level the JIT generates machine code at
+void setOptLevel(char level);
 void initJIT();
-void mainLoop();
\ No newline at end of file
+// Report a freshly compiled function: at -v=ir on stderr, and in the -dump-ir
+// file if it is selected. Nothing is formatted unless it is going to be shown.
+void showIR(const char *what, const Function &f);
+// true if definitions should start compiling as soon as they are added
+bool backgroundCompile();
+TargetMachine &initAOTTarget();
+void mainLoop();
+void runBatch();
+// true if -serve=<path> was given
+bool serving();
+// Listen on the -serve socket and run each client's session on its own
+// thread until accepting fails; returns the exit status. With hasLibrary, the
+// input is compiled first and its definitions are shared by every session.
+int serve(bool hasLibrary);
+std::vector<Function *> codegenAll();
+int compileAOT(const std::string &outFile);
+
+// Set the number of threads running parfor loops, the caller's included,
+// before the first one runs (see runtime.cpp).
+extern "C" void kal_parfor_threads(int n);
+// Send the calling thread's runtime errors, such as an array index out of
+// bounds, to handler instead of aborting; it must not return. Errors in
+// parfor bodies still abort. See runtime.cpp.
+extern "C" void kal_set_error_handler(void (*handler)(const char *message));
+
+// An array of doubles shared with compiled code without copying. Scripts
+// declare it with `extern name[]`, and every access reads data and length
+// from the descriptor, so the host may point it at other memory between
+// calls. Ahead-of-time compiled objects refer to a KalArray named `name`.
+struct KalArray {
+  double *data;
+  int64_t length;
+};
+// Bind `extern name[]` in the JIT to array, which must outlive the JIT.
+void bindArray(const std::string &name, KalArray *array);
+// Bind the files given with -array; false (after reporting why) if one
+// can't be mapped.
+bool bindArrayFiles();
+// Applies a compiled function to columns of numbers: out[r] = f(cols[0][r],
+// ..., cols[n-1][r]) for every row r < rows, with one column per parameter.
+// out may be one of the columns.
+using ColumnFunction = void (*)(const double *const *cols, double *out,
+                                int64_t rows);
+// The ColumnFunction of the function or extern called name. It is generated on
+// first use and cached. The loop calls a copy of the body, so LLVM can inline
+// and vectorize it instead of making one call per row. Call between top-level
+// items, on the thread that drives the compiler, and not with -tiered.
+Expected<ColumnFunction> getColumnFunction(StringRef name);
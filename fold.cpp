@@ -0,0 +1,28 @@
+#include "ast.h"
+
+// Constant folding on the AST, so that top-level expressions such as `1+2`
+// can be answered without generating code. Results must match what the
+// generated code computes, including how comparisons treat NaN.
+
+std::optional<double> BinaryExprAST::fold() const {
+  // user-defined operators are calls, and '=' is a store
+  if (!isBuiltinBinOp(op))
+    return std::nullopt;
+  auto l = lhs->fold();
+  if (!l)
+    return std::nullopt;
+  auto r = rhs->fold();
+  if (!r)
+    return std::nullopt;
+  return evalBuiltinBinOp(op, *l, *r);
+}
+
+std::optional<double> IfExprAST::fold() const {
+  // both branches must fold: the untaken one still has to be valid code
+  auto c = cond->fold();
+  auto t = c ? then_->fold() : std::nullopt;
+  auto e = t ? else_->fold() : std::nullopt;
+  if (!e)
+    return std::nullopt;
+  return isTrue(*c) ? *t : *e;
+}
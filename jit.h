@@ -11,10 +11,14 @@
 //===----------------------------------------------------------------------===//
 
 #pragma once
+#include "objcache.h"
+#include "stats.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -22,34 +26,113 @@
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ThreadPool.h"
 #include <memory>
 
 namespace llvm {
 namespace orc {
 
+// Runs JIT tasks (mostly materialization, i.e. compiling modules) on a fixed
+// pool of worker threads, so independent modules compile concurrently.
+class ThreadPoolTaskDispatcher : public TaskDispatcher {
+  ThreadPool Pool;
+
+public:
+  ThreadPoolTaskDispatcher(unsigned NumThreads)
+      : Pool(hardware_concurrency(NumThreads)) {}
+
+  void dispatch(std::unique_ptr<Task> T) override {
+    // ThreadPool wants a copyable callable, so pass the task as a raw pointer
+    Pool.async([UnownedT = T.release()]() {
+      std::unique_ptr<Task> T(UnownedT);
+      T->run();
+    });
+  }
+
+  void shutdown() override { Pool.wait(); }
+};
+
+// Compiles a module at the codegen level in its LevelFlag module flag, if it
+// has one, and at the builder's level otherwise. The flag is part of the IR,
+// so objects compiled at different levels are cached separately.
+class LevelIRCompiler : public IRCompileLayer::IRCompiler {
+  JITTargetMachineBuilder JTMB;
+  ObjectCache *ObjCache;
+
+public:
+  static constexpr const char *LevelFlag = "kal.codegen-level";
+
+  LevelIRCompiler(JITTargetMachineBuilder JTMB, ObjectCache *ObjCache)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(std::move(JTMB)), ObjCache(ObjCache) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    JITTargetMachineBuilder ModuleJTMB = JTMB;
+    if (auto *Level =
+            mdconst::extract_or_null<ConstantInt>(M.getModuleFlag(LevelFlag)))
+      ModuleJTMB.setCodeGenOptLevel((CodeGenOpt::Level)Level->getZExtValue());
+    return ConcurrentIRCompiler(std::move(ModuleJTMB), ObjCache)(M);
+  }
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
+
+  TimedObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  // for modules that run once: no object cache, own codegen level
+  IRCompileLayer ExprCompileLayer;
+  CompileOnDemandLayer CODLayer;
 
   JITDylib &MainJD;
 
+  // When set, modules are added through CODLayer: each function is replaced
+  // by a stub and only compiled the first time it is called.
+  bool Lazy;
+
+  static JITTargetMachineBuilder withOptLevel(JITTargetMachineBuilder JTMB,
+                                              CodeGenOpt::Level Level) {
+    JTMB.setCodeGenOptLevel(Level);
+    return JTMB;
+  }
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: could not find function body";
+    exit(1);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL, bool Lazy,
+                  std::unique_ptr<KaleidoscopeObjectCache> ObjCache,
+                  CodeGenOpt::Level ExprOptLevel)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL), ObjCache(std::move(ObjCache)),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    []() { return std::make_unique<CountingMemoryManager>(); }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     std::make_unique<TimedIRCompiler>(
+                         std::make_unique<LevelIRCompiler>(
+                             JTMB, this->ObjCache.get()))),
+        ExprCompileLayer(*this->ES, ObjectLayer,
+                         std::make_unique<TimedIRCompiler>(
+                             std::make_unique<ConcurrentIRCompiler>(
+                                 withOptLevel(JTMB, ExprOptLevel)))),
+        CODLayer(*this->ES, CompileLayer,
+                 this->EPCIU->getLazyCallThroughManager(),
+                 [this] { return this->EPCIU->createIndirectStubsManager(); }),
+        MainJD(this->ES->createBareJITDylib("<main>")), Lazy(Lazy) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
@@ -62,39 +145,145 @@ public:
   ~KaleidoscopeJIT() {
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (auto Err = EPCIU->cleanup())
+      ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  // If ObjCache is given, compiled objects are looked up in and added to it.
+  // With NumCompileThreads > 0, compilation runs on that many worker threads
+  // instead of the thread that triggered it. Modules added with
+  // addExprModule are compiled at ExprOptLevel.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(JITTargetMachineBuilder JTMB, bool Lazy = false,
+         std::unique_ptr<KaleidoscopeObjectCache> ObjCache = nullptr,
+         unsigned NumCompileThreads = 0,
+         CodeGenOpt::Level ExprOptLevel = CodeGenOpt::None) {
+    std::unique_ptr<TaskDispatcher> D;
+    if (NumCompileThreads)
+      D = std::make_unique<ThreadPoolTaskDispatcher>(NumCompileThreads);
+    auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    auto EPCIU = EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+    if (!EPCIU)
+      return EPCIU.takeError();
+
+    (*EPCIU)->createLazyCallThroughManager(
+        *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+
+    if (auto Err = setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+      return std::move(Err);
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*EPCIU),
+                                             std::move(JTMB), std::move(*DL),
+                                             Lazy, std::move(ObjCache),
+                                             ExprOptLevel);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // Create an empty dylib layered over MainJD: its own symbols come first,
+  // and everything in MainJD (and the process) stays visible behind them.
+  JITDylib &createSessionJITDylib(StringRef Name) {
+    JITDylib &JD = ES->createBareJITDylib(Name.str());
+    JD.addToLinkOrder(MainJD);
+    return JD;
+  }
+
+  // Drop JD and free the code and data of everything added to it.
+  Error removeJITDylib(JITDylib &JD) { return ES->removeJITDylib(JD); }
+
+  bool isLazy() const { return Lazy; }
+
+  KaleidoscopeObjectCache *getObjectCache() { return ObjCache.get(); }
+
+  // Add a module using the JIT's compilation mode (lazy or eager).
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    if (Lazy)
+      return CODLayer.add(RT, std::move(TSM));
+    return CompileLayer.add(RT, std::move(TSM));
+  }
+
+  // Add a module that is compiled as soon as any of its symbols is looked up,
+  // regardless of the compilation mode. Used for code that runs immediately.
+  Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  // Add a module of code that runs once, such as a top-level expression:
+  // compiled eagerly at the expression codegen level and never cached.
+  Error addExprModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return ExprCompileLayer.add(RT, std::move(TSM));
+  }
+
+  // Start materializing Names without waiting for the result. With compile
+  // threads this compiles them in the background; errors are reported to the
+  // session.
+  void prefetch(ArrayRef<std::string> Names) {
+    lookupAsync(Names, [this](Expected<std::vector<ExecutorAddr>> Result) {
+      if (!Result)
+        ES->reportError(Result.takeError());
+    });
+  }
+
+  // Look Names up without blocking. OnReady receives their addresses, in the
+  // same order, once they have been compiled; with compile threads it runs on
+  // one of them.
+  void lookupAsync(
+      ArrayRef<std::string> Names,
+      unique_function<void(Expected<std::vector<ExecutorAddr>>)> OnReady) {
+    std::vector<SymbolStringPtr> Mangled;
+    SymbolLookupSet Symbols;
+    for (auto &Name : Names) {
+      Mangled.push_back(Mangle(Name));
+      Symbols.add(Mangled.back());
+    }
+    ES->lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+        std::move(Symbols), SymbolState::Ready,
+        [Mangled = std::move(Mangled),
+         OnReady = std::move(OnReady)](Expected<SymbolMap> Result) mutable {
+          if (!Result)
+            return OnReady(Result.takeError());
+          std::vector<ExecutorAddr> Addrs;
+          for (auto &Name : Mangled)
+            Addrs.push_back((*Result)[Name].getAddress());
+          OnReady(std::move(Addrs));
+        },
+        NoDependenciesToRegister);
+  }
+
+  // Make Name resolve to Addr, e.g. data owned by the host.
+  Error defineAbsolute(StringRef Name, void *Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name), ExecutorSymbolDef(ExecutorAddr::fromPtr(Addr),
+                                          JITSymbolFlags::Exported)}}));
+  }
+
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  // Look Name up in a dylib from createSessionJITDylib, then in MainJD.
+  Expected<ExecutorSymbolDef> lookup(JITDylib &JD, StringRef Name) {
+    return ES->lookup(makeJITDylibSearchOrder({&JD, &MainJD}),
+                      Mangle(Name.str()));
+  }
 };
 
 } // end namespace orc
@@ -1,33 +1,106 @@
+#include "bytecode.h"
 #include "common.h"
+#include "memo.h"
 #include "parser.h"
+#include "stats.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+static cl::opt<std::string> inputFile(cl::Positional,
+                                      cl::desc("<input file>"),
+                                      cl::init("-"));
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double x) {
-  fputc((char)x, stderr);
-  return 0;
-}
+static cl::opt<std::string>
+    outputFile("o",
+               cl::desc("Compile ahead of time and write the result to "
+                        "<file> instead of running it"),
+               cl::value_desc("file"), cl::init(""));
 
-/// printd - print double
-extern "C" DLLEXPORT double printd(double x) {
-  fprintf(stdout, "%f\n", x);
-  return 0;
+static cl::opt<bool>
+    batchMode("batch",
+              cl::desc("Compile the whole input as one module before running "
+                       "any top-level expression"),
+              cl::init(false));
+
+static cl::opt<bool>
+    bytecodeMode("bc",
+                 cl::desc("Compile the whole input to bytecode and run it on "
+                          "the VM instead of the JIT"),
+                 cl::init(false));
+
+static cl::opt<std::string>
+    emitBytecodeFile("emit-bc",
+                     cl::desc("Compile to bytecode and write it to <file> "
+                              "instead of running it"),
+                     cl::value_desc("file"), cl::init(""));
+
+static cl::opt<int> parforThreads(
+    "threads",
+    cl::desc("Threads running parfor loops, this one included (default: "
+             "$KAL_THREADS, or one per CPU)"),
+    cl::init(0));
+
+static void reportStats() {
+  stats::counters.astNodes = ASTArena::totalNodes;
+  stats::counters.astBytes = ASTArena::totalBytes;
+  stats::report();
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+  // compiled bytecode runs without the parser or the JIT
+  if (inputFile != "-" && isBytecodeFile(inputFile)) {
+    auto module = readBytecode(inputFile);
+    int ret = module ? runBytecode(*module) : 1;
+    reportStats();
+    return ret;
+  }
+
+  if (inputFile != "-" && !setInputFile(inputFile)) {
+    errs() << "cannot open " << inputFile << "\n";
+    return 1;
+  }
+
+  if (bytecodeMode || !emitBytecodeFile.empty()) {
+    auto module = compileBytecode();
+    int ret;
+    if (!emitBytecodeFile.empty())
+      ret = writeBytecode(*module, emitBytecodeFile) ? 0 : 1;
+    else
+      ret = runBytecode(*module);
+    reportStats();
+    return ret;
+  }
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmParser();
   InitializeNativeTargetAsmPrinter();
 
+  if (!outputFile.empty()) {
+    int ret = compileAOT(outputFile);
+    reportStats();
+    return ret;
+  }
+
+  if (parforThreads > 0)
+    kal_parfor_threads(parforThreads);
   initJIT();
   initModuleAndPassMgr();
+  if (!bindArrayFiles())
+    return 1;
+
+  if (serving())
+    return serve(inputFile != "-");
+  if (batchMode)
+    runBatch();
+  else
+    mainLoop();
 
-  mainLoop();
+  if (auto *cache = theJIT->getObjectCache();
+      cache && verbosity >= Verbosity::info)
+    cache->printStats(errs());
+  reportMemoStats();
+  reportStats();
   return 0;
 }
\ No newline at end of file
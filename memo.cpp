@@ -0,0 +1,309 @@
+#include "memo.h"
+#include "codegen.h"
+#include "common.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+
+static cl::opt<bool>
+    autoMemo("auto-memo",
+             cl::desc("Memoize every pure function that calls itself more "
+                      "than once, as if it was declared with memo"),
+             cl::init(false));
+
+static cl::opt<unsigned> memoCapacity(
+    "memo-capacity",
+    cl::desc("Entries in each memoized function's result cache, rounded up "
+             "to a power of two (default = 4096)"),
+    cl::init(4096));
+
+// names of the memoized functions handed to the JIT, for reportMemoStats
+static std::vector<std::string> memoized;
+
+// libm functions without side effects that scripts declare as externs
+static bool isPureExtern(StringRef name) {
+  static const StringSet<> pure = [] {
+    StringSet<> s;
+    for (const char *n :
+         {"sin",  "cos",  "tan",   "asin",  "acos", "atan",  "atan2",
+          "sinh", "cosh", "tanh",  "exp",   "exp2", "log",   "log2",
+          "log10", "pow", "sqrt",  "cbrt",  "fabs", "floor", "ceil",
+          "round", "trunc", "fmod", "hypot", "fmin", "fmax"})
+      s.insert(n);
+    return s;
+  }();
+  return pure.contains(name);
+}
+
+// Reported as the callee of every array access: memory is not part of the
+// cache key, so reading or writing it is as impure as an unknown call. No
+// identifier can have this name.
+static SymbolID arrayAccess() {
+  static SymbolID sym = symbols.internPermanent("[]");
+  return sym;
+}
+
+// Whether def is pure, and how many call sites of itself its body has. The
+// result, and whether def calls memoized code, is kept on the prototype, so
+// it is seen wherever the prototype is.
+static bool analyze(const FunctionAST &def, unsigned &selfCalls) {
+  SymbolID self = def.getProto().getNameID();
+  bool pure = !def.getProto().hasArrayArgs(), memoCaller = false;
+  selfCalls = 0;
+  def.getBody().forEachCallee([&](SymbolID callee) {
+    if (callee == self) {
+      selfCalls++;
+      return;
+    }
+    PrototypeAST *calleeProto = functionProtos.lookup(callee);
+    if (calleeProto && calleeProto->isAnalyzed()) {
+      pure &= calleeProto->isPure();
+      memoCaller |= calleeProto->isMemo() || calleeProto->isMemoCaller();
+    } else {
+      pure &= calleeProto && isPureExtern(symbols.getName(callee));
+    }
+  });
+  const_cast<PrototypeAST &>(def.getProto()).setAnalysis(pure, memoCaller);
+  return pure;
+}
+
+void analyzePurity(const FunctionAST &def) {
+  unsigned selfCalls;
+  analyze(def, selfCalls);
+}
+
+bool isPure(SymbolID name) {
+  PrototypeAST *proto = functionProtos.lookup(name);
+  return proto && proto->isPure();
+}
+
+bool prepareMemo(const FunctionAST &def) {
+  const PrototypeAST &proto = def.getProto();
+  unsigned selfCalls;
+  bool pure = analyze(def, selfCalls);
+  if (proto.isMemo() && !pure) {
+    LogError("memo function must be pure: it may only call pure functions");
+    return false;
+  }
+  bool memo = proto.isMemo() || (autoMemo && pure && selfCalls > 1);
+  const_cast<PrototypeAST &>(proto).setMemo(memo);
+  if (memo)
+    memoized.push_back(proto.getName().str());
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Code generation
+//===----------------------------------------------------------------------===//
+//
+// Each entry of f's cache @f.memo is { [N x i64] args, double result,
+// i8 filled }, indexed by a multiplicative hash of the arguments' bit
+// patterns, so -0.0 and 0.0 (and NaNs) are cached separately. Colliding calls
+// overwrite each other. The i64 counters @f.memo.hits and @f.memo.misses
+// are external so the driver can read them at exit.
+
+static StructType *entryType(Function *f) {
+  LLVMContext &ctx = f->getContext();
+  return StructType::get(
+      ctx, {ArrayType::get(Type::getInt64Ty(ctx), f->arg_size()),
+            Type::getDoubleTy(ctx), Type::getInt8Ty(ctx)});
+}
+
+static GlobalVariable *getCounter(Function *f, StringRef kind) {
+  Type *i64 = Builder->getInt64Ty();
+  return new GlobalVariable(*f->getParent(), i64, false,
+                            GlobalValue::ExternalLinkage,
+                            ConstantInt::get(i64, 0),
+                            f->getName() + ".memo." + kind);
+}
+
+static void increment(GlobalVariable *counter) {
+  Type *i64 = Builder->getInt64Ty();
+  Value *n = Builder->CreateLoad(i64, counter);
+  Builder->CreateStore(Builder->CreateAdd(n, ConstantInt::get(i64, 1)),
+                       counter);
+}
+
+Value *emitMemoLookup(Function *theFunc) {
+  uint64_t capacity = PowerOf2Ceil(std::max(memoCapacity.getValue(), 1u));
+  StructType *entryTy = entryType(theFunc);
+  ArrayType *tableTy = ArrayType::get(entryTy, capacity);
+  auto *table = new GlobalVariable(
+      *theModule, tableTy, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(tableTy), theFunc->getName() + ".memo");
+  GlobalVariable *hits = getCounter(theFunc, "hits");
+  GlobalVariable *misses = getCounter(theFunc, "misses");
+
+  Type *i64 = Builder->getInt64Ty();
+  SmallVector<Value *, 4> keys;
+  Value *hash = ConstantInt::get(i64, 0);
+  for (Argument &arg : theFunc->args()) {
+    keys.push_back(Builder->CreateBitCast(&arg, i64));
+    hash = Builder->CreateMul(Builder->CreateXor(hash, keys.back()),
+                              ConstantInt::get(i64, 0x9e3779b97f4a7c15ULL));
+  }
+  // the high bits are the best mixed
+  Value *index = ConstantInt::get(i64, 0);
+  if (unsigned bits = Log2_64(capacity))
+    index = Builder->CreateLShr(hash, 64 - bits);
+  Value *entry = Builder->CreateInBoundsGEP(
+      tableTy, table, {ConstantInt::get(i64, 0), index}, "memo.entry");
+
+  Value *hit = Builder->CreateICmpNE(
+      Builder->CreateLoad(Builder->getInt8Ty(),
+                          Builder->CreateStructGEP(entryTy, entry, 2)),
+      Builder->getInt8(0));
+  for (size_t i = 0; i < keys.size(); i++) {
+    Value *slot = Builder->CreateInBoundsGEP(
+        entryTy, entry, {Builder->getInt32(0), Builder->getInt32(0),
+                         Builder->getInt32(i)});
+    hit = Builder->CreateAnd(
+        hit, Builder->CreateICmpEQ(Builder->CreateLoad(i64, slot), keys[i]));
+  }
+
+  BasicBlock *hitBB = BasicBlock::Create(*theContext, "memo.hit", theFunc);
+  BasicBlock *missBB = BasicBlock::Create(*theContext, "memo.miss", theFunc);
+  Builder->CreateCondBr(hit, hitBB, missBB);
+
+  Builder->SetInsertPoint(hitBB);
+  increment(hits);
+  Builder->CreateRet(Builder->CreateLoad(
+      Builder->getDoubleTy(), Builder->CreateStructGEP(entryTy, entry, 1)));
+
+  Builder->SetInsertPoint(missBB);
+  increment(misses);
+  return entry;
+}
+
+void emitMemoStore(Function *theFunc, Value *entry, Value *result) {
+  StructType *entryTy = entryType(theFunc);
+  unsigned i = 0;
+  for (Argument &arg : theFunc->args()) {
+    Value *slot = Builder->CreateInBoundsGEP(
+        entryTy, entry, {Builder->getInt32(0), Builder->getInt32(0),
+                         Builder->getInt32(i++)});
+    Builder->CreateStore(Builder->CreateBitCast(&arg, Builder->getInt64Ty()),
+                         slot);
+  }
+  Builder->CreateStore(result, Builder->CreateStructGEP(entryTy, entry, 1));
+  Builder->CreateStore(Builder->getInt8(1),
+                       Builder->CreateStructGEP(entryTy, entry, 2));
+}
+
+ArrayRef<std::string> memoizedFunctions() { return memoized; }
+
+void forgetMemoized(ArrayRef<std::string> names) {
+  // a name may be listed more than once, by different sessions of -serve
+  for (const std::string &name : names) {
+    auto it = std::find(memoized.begin(), memoized.end(), name);
+    if (it != memoized.end())
+      memoized.erase(it);
+  }
+}
+
+void reportMemoStats() {
+  if (!theJIT || !(stats::enabled() || verbosity >= Verbosity::info))
+    return;
+  for (const std::string &name : memoized) {
+    auto hits = theJIT->lookup(name + ".memo.hits");
+    auto misses = theJIT->lookup(name + ".memo.misses");
+    if (!hits || !misses) {
+      consumeError(hits.takeError());
+      consumeError(misses.takeError());
+      continue;
+    }
+    uint64_t h = *hits->getAddress().toPtr<uint64_t *>();
+    uint64_t m = *misses->getAddress().toPtr<uint64_t *>();
+    stats::counters.memoHits += h;
+    stats::counters.memoMisses += m;
+    LogInfo("memo %s: %llu hits, %llu misses (%.1f%% hit rate)\n",
+            name.c_str(), (unsigned long long)h, (unsigned long long)m,
+            h + m ? 100.0 * h / (h + m) : 0.0);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// ExprAST::forEachCallee
+//===----------------------------------------------------------------------===//
+
+void NumberExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {}
+
+void VariableExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {}
+
+void VarExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  for (const auto &p : varNames)
+    if (p.second)
+      p.second->forEachCallee(fn);
+  body->forEachCallee(fn);
+}
+
+void UnaryExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  operand->forEachCallee(fn);
+  fn(operatorSymbol(false, op));
+}
+
+void BinaryExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  lhs->forEachCallee(fn);
+  rhs->forEachCallee(fn);
+  if (op != '=' && !isBuiltinBinOp(op))
+    fn(operatorSymbol(true, op));
+}
+
+void CallExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  for (ExprAST *arg : args)
+    arg->forEachCallee(fn);
+  fn(callee);
+}
+
+void IfExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  cond->forEachCallee(fn);
+  then_->forEachCallee(fn);
+  else_->forEachCallee(fn);
+}
+
+void ForExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  start->forEachCallee(fn);
+  end->forEachCallee(fn);
+  if (step)
+    step->forEachCallee(fn);
+  body->forEachCallee(fn);
+}
+
+void ParforExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  start->forEachCallee(fn);
+  bound->forEachCallee(fn);
+  if (step)
+    step->forEachCallee(fn);
+  body->forEachCallee(fn);
+  if (reduceOp && !isBuiltinBinOp(reduceOp))
+    fn(operatorSymbol(true, reduceOp));
+}
+
+void IndexExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  index->forEachCallee(fn);
+  fn(arrayAccess());
+}
+
+void ArrayStoreExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  index->forEachCallee(fn);
+  value->forEachCallee(fn);
+  fn(arrayAccess());
+}
+
+void ArrayLenExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  fn(arrayAccess());
+}
+
+void ArrayVarExprAST::forEachCallee(function_ref<void(SymbolID)> fn) const {
+  size->forEachCallee(fn);
+  body->forEachCallee(fn);
+  fn(arrayAccess());
+}
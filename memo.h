@@ -0,0 +1,38 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm/IR/Function.h"
+
+#include <string>
+
+// Memoization of pure functions: `def memo f(...)`, or any pure function
+// that calls itself more than once with -auto-memo. A memoized function
+// looks its arguments up in a direct-mapped cache of -memo-capacity entries
+// before running its body, and stores the result there on return. Only
+// machine code memoizes; tier 0 and the bytecode VM run the body every time.
+
+// Record whether def is pure: it only calls pure functions, itself, and
+// side-effect-free libm functions, and uses no arrays. Definitions are analyzed in source order,
+// when they are entered, so calls to anything not seen yet count as impure.
+void analyzePurity(const FunctionAST &def);
+// whether the definition of name was analyzed and found pure
+bool isPure(SymbolID name);
+
+// Decide whether def's compiled code is memoized and mark its prototype.
+// Asking for memo on an impure function is an error; returns false then.
+bool prepareMemo(const FunctionAST &def);
+
+// Emit the cache lookup at the current insert point of theFunc, which must be
+// memoized. Hits return from the function; code after it runs on misses.
+// Returns the cache entry to pass to emitMemoStore before the function's ret.
+Value *emitMemoLookup(Function *theFunc);
+void emitMemoStore(Function *theFunc, Value *entry, Value *result);
+
+// names of the functions memoized so far
+ArrayRef<std::string> memoizedFunctions();
+// Forget memoized functions whose code was removed from the JIT.
+void forgetMemoized(ArrayRef<std::string> names);
+
+// Add the hit and miss counts of every memoized function in the JIT to the
+// statistics; at -v=info, also list them per function.
+void reportMemoStats();
@@ -0,0 +1,177 @@
+#include "objcache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+
+KaleidoscopeObjectCache::KaleidoscopeObjectCache(StringRef cacheDir,
+                                                 StringRef settings,
+                                                 uint64_t maxBytes)
+    : cacheDir(cacheDir), settings(settings), maxBytes(maxBytes) {
+  if (auto ec = sys::fs::create_directories(this->cacheDir))
+    errs() << "object cache: cannot create " << this->cacheDir << ": "
+           << ec.message() << "\n";
+
+  // account for objects left behind by previous runs, and remove temporary
+  // files that a run which died while writing them left behind. Anything
+  // else in the directory is none of our business.
+  auto now = std::chrono::system_clock::now();
+  std::error_code ec;
+  for (sys::fs::directory_iterator it(this->cacheDir, ec), end;
+       it != end && !ec; it.increment(ec)) {
+    auto st = it->status();
+    if (!st || st->type() != sys::fs::file_type::regular_file)
+      continue;
+    StringRef name = sys::path::filename(it->path());
+    if (isCacheObject(name))
+      totalBytes += st->getSize();
+    else if (isTempObject(name) &&
+             now - st->getLastModificationTime() > std::chrono::hours(1))
+      sys::fs::remove(it->path());
+  }
+}
+
+// "<md5>.o", as named by getCachePath.
+bool KaleidoscopeObjectCache::isCacheObject(StringRef name) {
+  return name.size() == 34 && name.endswith(".o") &&
+         name.take_front(32).find_first_not_of("0123456789abcdef") ==
+             StringRef::npos;
+}
+
+// "<md5>.o.tmp-XXXXXX", as created by notifyObjectCompiled.
+bool KaleidoscopeObjectCache::isTempObject(StringRef name) {
+  size_t tmp = name.find(".tmp-");
+  return tmp != StringRef::npos && isCacheObject(name.take_front(tmp));
+}
+
+std::string KaleidoscopeObjectCache::getCachePath(const Module *M) const {
+  std::string ir;
+  raw_string_ostream os(ir);
+  M->print(os, nullptr);
+  os.flush();
+
+  MD5 hash;
+  hash.update(settings);
+  hash.update(ir);
+  MD5::MD5Result result;
+  hash.final(result);
+
+  SmallString<128> path(cacheDir);
+  sys::path::append(path, result.digest() + ".o");
+  return std::string(path.str());
+}
+
+std::unique_ptr<MemoryBuffer>
+KaleidoscopeObjectCache::getObject(const Module *M) {
+  std::string path = getCachePath(M);
+  auto buf = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!buf) {
+    misses++;
+    // the module is compiled next and comes back in notifyObjectCompiled;
+    // don't print and hash it again there
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pendingPaths[M] = std::move(path);
+    return nullptr;
+  }
+  hits++;
+
+  // bump the modification time so this object counts as recently used
+  int fd;
+  if (!sys::fs::openFileForReadWrite(path, fd, sys::fs::CD_OpenExisting,
+                                     sys::fs::OF_None)) {
+    sys::fs::setLastAccessAndModificationTime(
+        fd, std::chrono::system_clock::now());
+    sys::Process::SafelyCloseFileDescriptor(fd);
+  }
+  return std::move(*buf);
+}
+
+void KaleidoscopeObjectCache::notifyObjectCompiled(const Module *M,
+                                                   MemoryBufferRef obj) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    auto it = pendingPaths.find(M);
+    if (it != pendingPaths.end()) {
+      path = std::move(it->second);
+      pendingPaths.erase(it);
+    }
+  }
+  if (path.empty())
+    path = getCachePath(M);
+
+  // write to a temporary file first so concurrent readers never see a
+  // partially written object
+  int fd;
+  SmallString<128> tmpPath;
+  if (sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmpPath))
+    return;
+  {
+    raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << obj.getBuffer();
+  }
+  std::lock_guard<std::mutex> lock(dirMutex);
+  // an object that is already there (written by another run, say) is
+  // replaced, so only the difference in size counts
+  uint64_t oldSize = 0;
+  if (sys::fs::file_size(path, oldSize))
+    oldSize = 0;
+  if (sys::fs::rename(tmpPath, path)) {
+    sys::fs::remove(tmpPath);
+    return;
+  }
+  totalBytes -= std::min(oldSize, totalBytes);
+  totalBytes += obj.getBufferSize();
+  if (totalBytes > maxBytes)
+    evict();
+}
+
+void KaleidoscopeObjectCache::evict() {
+  struct Entry {
+    sys::TimePoint<> mtime;
+    uint64_t size;
+    std::string path;
+  };
+  std::vector<Entry> entries;
+  totalBytes = 0;
+  std::error_code ec;
+  for (sys::fs::directory_iterator it(cacheDir, ec), end; it != end && !ec;
+       it.increment(ec)) {
+    auto st = it->status();
+    if (!st || st->type() != sys::fs::file_type::regular_file ||
+        !isCacheObject(sys::path::filename(it->path())))
+      continue;
+    entries.push_back({st->getLastModificationTime(), st->getSize(),
+                       it->path()});
+    totalBytes += st->getSize();
+  }
+
+  // drop the least recently used objects until we are back under the cap
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+  for (auto &e : entries) {
+    if (totalBytes <= maxBytes)
+      break;
+    if (!sys::fs::remove(e.path)) {
+      totalBytes -= e.size;
+      evictions++;
+    }
+  }
+}
+
+void KaleidoscopeObjectCache::printStats(raw_ostream &os) const {
+  unsigned total = hits + misses;
+  os << "object cache: " << hits << " hits, " << misses << " misses";
+  if (total)
+    os << format(" (%.1f%% hit rate)", 100.0 * hits / total);
+  os << ", " << evictions << " evictions, " << totalBytes / 1024
+     << " KiB in " << cacheDir << "\n";
+}
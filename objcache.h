@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// On-disk cache of JIT-compiled object files. Objects are keyed by a hash of
+// the module's (already optimized) IR together with the target settings the
+// JIT compiles for, so changing the CPU or codegen options never returns a
+// stale object. The directory is capped in size; the least recently used
+// objects are evicted first, using file modification times as the LRU clock.
+// Only files named like the cache's own objects are counted or evicted.
+class KaleidoscopeObjectCache : public ObjectCache {
+  std::string cacheDir;
+  std::string settings;
+  uint64_t maxBytes;
+
+  std::mutex dirMutex; // guards totalBytes and eviction
+  uint64_t totalBytes = 0;
+
+  std::atomic<unsigned> hits{0}, misses{0}, evictions{0};
+
+  // Paths of modules that missed in getObject and are being compiled, so
+  // notifyObjectCompiled needn't hash them again.
+  std::mutex pendingMutex;
+  DenseMap<const Module *, std::string> pendingPaths;
+
+  static bool isCacheObject(StringRef name);
+  static bool isTempObject(StringRef name);
+  std::string getCachePath(const Module *M) const;
+  void evict();
+
+public:
+  KaleidoscopeObjectCache(StringRef cacheDir, StringRef settings,
+                          uint64_t maxBytes);
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef obj) override;
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override;
+
+  unsigned getHits() const { return hits; }
+  unsigned getMisses() const { return misses; }
+  void printStats(raw_ostream &os) const;
+};
@@ -1,87 +1,211 @@
 #include "parser.h"
 #include "ast.h"
 #include "common.h"
+#include "stats.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
 #include <exception>
 #include <map>
 #include <memory>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <unistd.h>
 #include <vector>
 
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Support/AtomicOrdering.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+static std::string_view identifierStr; // Filled in if tok_identifier
+static double numVal;                  // Filled in if tok_number
+
+// The lexer works on a buffer of input characters: either a whole
+// memory-mapped file, or chunks read from a file descriptor (stdin by
+// default). Tokens are views into that buffer, so identifierStr is only valid
+// until the next call to getNextToken().
+static std::unique_ptr<MemoryBuffer> inputFile;
+static int inputFD = 0; // -1 once all input is in the buffer
+static std::vector<char> streamBuf;
+static const char *curPtr = nullptr, *bufEnd = nullptr;
+static const char *tokStart = nullptr; // start of the token being lexed
+
+bool setInputFile(const std::string &path) {
+  auto buf = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!buf)
+    return false;
+  inputFile = std::move(*buf);
+  inputFD = -1;
+  curPtr = tokStart = inputFile->getBufferStart();
+  bufEnd = inputFile->getBufferEnd();
+  return true;
+}
+
+void setInputFD(int fd) {
+  inputFile.reset();
+  inputFD = fd;
+  curPtr = tokStart = bufEnd = nullptr;
+}
+
+void setInputBuffer(StringRef text) {
+  inputFile = MemoryBuffer::getMemBuffer(text, "", false);
+  inputFD = -1;
+  curPtr = tokStart = inputFile->getBufferStart();
+  bufEnd = inputFile->getBufferEnd();
+}
+
+// Read more input after the end of the buffer, keeping the partial token that
+// starts at tokStart. Returns false at end of input.
+static bool refill() {
+  if (inputFD < 0)
+    return false;
+  size_t keep = bufEnd - tokStart;
+  if (keep)
+    memmove(streamBuf.data(), tokStart, keep);
+  if (streamBuf.size() < keep + 4096)
+    streamBuf.resize(std::max<size_t>(64 * 1024, 2 * streamBuf.size()));
+
+  // read() returns whatever is available, so interactive input is handled
+  // line by line while pipes and files are read in large chunks
+  ssize_t n;
+  do
+    n = read(inputFD, streamBuf.data() + keep, streamBuf.size() - keep);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  tokStart = streamBuf.data();
+  curPtr = tokStart + keep;
+  bufEnd = curPtr + n;
+  return true;
+}
+
+static inline int peekChar() {
+  if (curPtr == bufEnd && !refill())
+    return EOF;
+  return (unsigned char)*curPtr;
+}
 
-static std::string identifierStr; // Filled in if tok_identifier
-static double numVal;             // Filled in if tok_number
+static int getKeyword(std::string_view str) {
+  return StringSwitch<int>(StringRef(str.data(), str.size()))
+      .Case("def", tok_def)
+      .Case("extern", tok_extern)
+      .Case("if", tok_if)
+      .Case("then", tok_then)
+      .Case("else", tok_else)
+      .Case("for", tok_for)
+      .Case("in", tok_in)
+      .Case("unary", tok_unary)
+      .Case("binary", tok_binary)
+      .Case("var", tok_var)
+      .Case("fastmath", tok_fastmath)
+      .Case("memo", tok_memo)
+      .Case("len", tok_len)
+      .Case("parfor", tok_parfor)
+      .Case("reduce", tok_reduce)
+      .Default(tok_identifier);
+}
 
-static std::unordered_map<std::string, int> tokMap = {
-    {"def", tok_def},   {"extern", tok_extern}, {"if", tok_if},
-    {"then", tok_then}, {"else", tok_else},     {"for", tok_for},
-    {"in", tok_in},     {"unary", tok_unary},   {"binary", tok_binary},
-    {"var", tok_var},
-};
+// Parse a run of digits and dots like strtod would (stopping at a second
+// dot). Numbers with at most 2^53 as significand and 22 fractional digits
+// convert exactly with a single division; anything else falls back to strtod.
+static double parseNumber(const char *start, const char *end) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  const uint64_t maxExact = 1ull << 53;
+  uint64_t mantissa = 0;
+  unsigned fracDigits = 0;
+  bool seenDot = false, exact = true;
+  const char *p = start;
+  for (; p != end; ++p) {
+    if (*p == '.') {
+      if (seenDot)
+        break;
+      seenDot = true;
+      continue;
+    }
+    if (mantissa > (maxExact - 9) / 10)
+      exact = false;
+    mantissa = mantissa * 10 + (*p - '0');
+    fracDigits += seenDot;
+  }
+  if (exact && fracDigits <= 22)
+    return (double)mantissa / pow10[fracDigits];
+  return strtod(std::string(start, p).c_str(), nullptr);
+}
 
 static int getTok() {
-  static int lastChar = ' ';
-  while (isspace(lastChar)) {
-    lastChar = getchar();
+  int c;
+  while (true) {
+    tokStart = curPtr;
+    c = peekChar();
+    if (c == '#') { // comment until end of line
+      do
+        tokStart = ++curPtr;
+      while ((c = peekChar()) != EOF && c != '\n' && c != '\r');
+    }
+    if (!isspace(c))
+      break;
+    ++curPtr;
   }
-  if (isalpha(lastChar)) {
-    identifierStr = lastChar;
-    while (isalnum((lastChar = getchar())))
-      identifierStr += lastChar;
-    auto it = tokMap.find(identifierStr);
-    if (it != tokMap.end())
-      return it->second;
-    return tok_identifier;
-  } else if (isdigit(lastChar) || lastChar == '.') {
-    std::string numStr;
-    do {
-      numStr += lastChar;
-      lastChar = getchar();
-    } while (isdigit(lastChar) || lastChar == '.');
-    numVal = strtod(numStr.c_str(), 0);
-    return tok_number;
-  } else if (lastChar == '#') {
+  tokStart = curPtr;
+
+  if (isalpha(c)) {
     do
-      lastChar = getchar();
-    while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-    if (lastChar != EOF) {
-      return getTok();
-    }
+      ++curPtr;
+    while (isalnum(peekChar()));
+    identifierStr = std::string_view(tokStart, curPtr - tokStart);
+    return getKeyword(identifierStr);
   }
-  if (lastChar == EOF) {
-    return tok_eof;
-  } else {
-    int thisChar = lastChar;
-    lastChar = getchar();
-    return thisChar;
+  if (isdigit(c) || c == '.') {
+    do
+      ++curPtr;
+    while (isdigit(c = peekChar()) || c == '.');
+    numVal = parseNumber(tokStart, curPtr);
+    return tok_number;
   }
+  if (c == EOF)
+    return tok_eof;
+  ++curPtr;
+  return c;
 }
 
 int curTok = 0;
-int getNextToken() { return curTok = getTok(); }
+int getNextToken() {
+  PhaseTimer timer(Phase::lex);
+  return curTok = getTok();
+}
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
+PrototypeAST *LogErrorP(const char *str) {
   LogError(str);
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> parseExpr();
+SymbolTable symbols;
+ASTArena defArena, exprArena;
+// arena the expression being parsed is allocated in
+static ASTArena *arena = &defArena;
+
+static ExprAST *parseExpr();
+static ExprAST *parseUnary();
+static ExprAST *parseBinOpRhs(int exprPrec, ExprAST *lhs);
 
-static std::unique_ptr<ExprAST> parseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(numVal);
+static ExprAST *parseNumberExpr() {
+  auto result = arena->make<NumberExprAST>(numVal);
   getNextToken();
   LogDebug("parseNumberExpr: %f\n", numVal);
-  return std::move(result);
+  return result;
 }
 
-static std::unique_ptr<ExprAST> parseParenExpr() {
+static ExprAST *parseParenExpr() {
   getNextToken(); // eat (
   auto v = parseExpr();
   if (!v) {
@@ -95,20 +219,43 @@ static std::unique_ptr<ExprAST> parseParenExpr() {
   return v;
 }
 
-static std::unique_ptr<ExprAST> parseIdentifierExpr() {
-  std::string idName = identifierStr;
-  getNextToken();      // eat identifier
+// array[index], or array[index] = value
+static ExprAST *parseIndexExpr(SymbolID array) {
+  getNextToken(); // eat [
+  auto index = parseExpr();
+  if (!index)
+    return nullptr;
+  if (curTok != ']')
+    return LogError("expected ']' after array index");
+  getNextToken();
+  if (curTok != '=')
+    return arena->make<IndexExprAST>(array, index);
+
+  // the value extends as far as it would after a variable's '='
+  getNextToken();
+  auto value = parseUnary();
+  if (value)
+    value = parseBinOpRhs(binOpPrecedence['='] + 1, value);
+  if (!value)
+    return nullptr;
+  return arena->make<ArrayStoreExprAST>(array, index, value);
+}
+
+// the rest of an expression that starts with the identifier idName
+static ExprAST *parseIdentifierRest(SymbolID idName) {
+  if (curTok == '[')
+    return parseIndexExpr(idName);
   if (curTok != '(') { // simple variable reference
-    LogDebug("parseIdentifierExpr: %s\n", idName.c_str());
-    return std::make_unique<VariableExprAST>(idName);
+    LogDebug("parseIdentifierExpr: %s\n", symbols.getName(idName).data());
+    return arena->make<VariableExprAST>(idName);
   }
   // call expression
   getNextToken();
-  std::vector<std::unique_ptr<ExprAST>> args;
+  SmallVector<ExprAST *, 8> args;
   if (curTok != ')') {
     while (1) {
       if (auto arg = parseExpr())
-        args.push_back(std::move(arg));
+        args.push_back(arg);
       else
         return nullptr;
       if (curTok == ')')
@@ -119,13 +266,50 @@ static std::unique_ptr<ExprAST> parseIdentifierExpr() {
     }
   }
   getNextToken(); // eat )
-  LogDebug("parseIdentifierExpr: call %s(%d args)\n", idName.c_str(),
-           args.size());
-  return std::make_unique<CallExprAST>(idName, std::move(args));
+  LogDebug("parseIdentifierExpr: call %s(%d args)\n",
+           symbols.getName(idName).data(), args.size());
+  return arena->make<CallExprAST>(idName, arena->copy<ExprAST *>(args));
 }
 
-static std::unique_ptr<ExprAST> parseVarExpr() {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
+static ExprAST *parseIdentifierExpr() {
+  SymbolID idName = symbols.intern(identifierStr);
+  getNextToken(); // eat identifier
+  return parseIdentifierRest(idName);
+}
+
+// len(array)
+static ExprAST *parseLenExpr() {
+  getNextToken(); // eat len
+  if (curTok != '(')
+    return LogError("expected '(' after len");
+  if (getNextToken() != tok_identifier)
+    return LogError("expected array name in len");
+  SymbolID array = symbols.intern(identifierStr);
+  if (getNextToken() != ')')
+    return LogError("expected ')' after array name");
+  getNextToken();
+  return arena->make<ArrayLenExprAST>(array);
+}
+
+// var name[size] in body
+static ExprAST *parseArrayVarExpr(SymbolID name) {
+  getNextToken(); // eat [
+  auto size = parseExpr();
+  if (!size)
+    return nullptr;
+  if (curTok != ']')
+    return LogError("expected ']' after array size");
+  if (getNextToken() != tok_in)
+    return LogError("expected in after array variable");
+  getNextToken();
+  auto body = parseExpr();
+  if (!body)
+    return nullptr;
+  return arena->make<ArrayVarExprAST>(name, size, body);
+}
+
+static ExprAST *parseVarExpr() {
+  SmallVector<std::pair<SymbolID, ExprAST *>, 4> varNames;
 
   getNextToken();
   if (curTok != tok_identifier)
@@ -133,11 +317,14 @@ static std::unique_ptr<ExprAST> parseVarExpr() {
 
   // parse list of identifiers
   while (true) {
-    std::string varName = identifierStr;
+    SymbolID varName = symbols.intern(identifierStr);
     getNextToken();
+    // an array is declared on its own
+    if (curTok == '[' && varNames.empty())
+      return parseArrayVarExpr(varName);
 
     // read optional initializer
-    std::unique_ptr<ExprAST> init;
+    ExprAST *init = nullptr;
     if (curTok == '=') {
       getNextToken();
       init = parseExpr();
@@ -145,7 +332,7 @@ static std::unique_ptr<ExprAST> parseVarExpr() {
         return nullptr;
     }
 
-    varNames.emplace_back(varName, std::move(init));
+    varNames.emplace_back(varName, init);
     if (curTok != ',')
       break;
     getNextToken();
@@ -160,10 +347,11 @@ static std::unique_ptr<ExprAST> parseVarExpr() {
   auto body = parseExpr();
   if (!body)
     return nullptr;
-  return std::make_unique<VarExprAST>(std::move(varNames), std::move(body));
+  return arena->make<VarExprAST>(
+      arena->copy<std::pair<SymbolID, ExprAST *>>(varNames), body);
 }
 
-static std::unique_ptr<ExprAST> parseIfExpr() {
+static ExprAST *parseIfExpr() {
   getNextToken();
   auto cond = parseExpr();
   if (!cond)
@@ -184,16 +372,16 @@ static std::unique_ptr<ExprAST> parseIfExpr() {
     return nullptr;
 
   LogDebug("parseIfExpr\n");
-  return std::make_unique<IfExprAST>(std::move(cond), std::move(then_),
-                                     std::move(else_));
+  return arena->make<IfExprAST>(cond, then_, else_);
 }
 
-static std::unique_ptr<ExprAST> parseForExpr() {
-  getNextToken(); // eat for
+// for or parfor; only the latter takes a reduction operator
+static ExprAST *parseForExpr(bool parallel) {
+  getNextToken(); // eat for or parfor
 
   if (curTok != tok_identifier)
     return LogError("expected identifier after for");
-  std::string varName = identifierStr;
+  SymbolID varName = symbols.intern(identifierStr);
   getNextToken();
 
   if (curTok != '=')
@@ -207,12 +395,40 @@ static std::unique_ptr<ExprAST> parseForExpr() {
     return LogError("expected ',' after start value");
   getNextToken();
 
-  auto end = parseExpr();
+  // `var < bound` lets codegen count with an integer; anything else is a
+  // general condition
+  ExprAST *end, *bound = nullptr;
+  if (curTok == tok_identifier &&
+      symbols.intern(identifierStr) == varName) {
+    getNextToken();
+    if (curTok == '<') {
+      getNextToken();
+      bound = parseUnary();
+      if (bound)
+        bound = parseBinOpRhs(binOpPrecedence['<'] + 1, bound);
+      if (!bound)
+        return nullptr;
+      auto var = arena->make<VariableExprAST>(varName);
+      end = arena->make<BinaryExprAST>('<', var, bound);
+    } else {
+      end = parseIdentifierRest(varName);
+    }
+    ExprAST *cond = end ? parseBinOpRhs(0, end) : nullptr;
+    if (cond != end)
+      bound = nullptr;
+    end = cond;
+  } else {
+    end = parseExpr();
+  }
   if (!end)
     return nullptr;
 
+  // the iterations of a parfor are counted before any of them runs
+  if (parallel && !bound)
+    return LogError("expected the end condition of parfor to be `var < bound`");
+
   // optional step value
-  std::unique_ptr<ExprAST> step;
+  ExprAST *step = nullptr;
   if (curTok == ',') {
     getNextToken();
     step = parseExpr();
@@ -220,6 +436,15 @@ static std::unique_ptr<ExprAST> parseForExpr() {
       return nullptr;
   }
 
+  char reduceOp = 0;
+  if (parallel && curTok == tok_reduce) {
+    getNextToken();
+    if (!isascii(curTok) || binOpPrecedence[curTok] <= 0 || curTok == '=')
+      return LogError("expected a binary operator after reduce");
+    reduceOp = curTok;
+    getNextToken();
+  }
+
   if (curTok != tok_in)
     return LogError("expected 'in' after for");
   getNextToken();
@@ -228,11 +453,13 @@ static std::unique_ptr<ExprAST> parseForExpr() {
   if (!body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(varName, std::move(start), std::move(end),
-                                      std::move(step), std::move(body));
+  if (parallel)
+    return arena->make<ParforExprAST>(varName, start, bound, step, body,
+                                      reduceOp);
+  return arena->make<ForExprAST>(varName, start, end, step, body, bound);
 }
 
-static std::unique_ptr<ExprAST> parsePrimary() {
+static ExprAST *parsePrimary() {
   switch (curTok) {
   case tok_identifier:
     return parseIdentifierExpr();
@@ -243,27 +470,45 @@ static std::unique_ptr<ExprAST> parsePrimary() {
   case tok_if:
     return parseIfExpr();
   case tok_for:
-    return parseForExpr();
+    return parseForExpr(false);
+  case tok_parfor:
+    return parseForExpr(true);
   case tok_var:
     return parseVarExpr();
+  case tok_len:
+    return parseLenExpr();
   default:
     return LogError("unknown token when expecting an expresssion");
   }
 }
 
 // binary expression
-std::map<char, int> binOpPrecedence = {
-    // 1 is lowest precedence
-    {'=', 2}, {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}, {'/', 40}};
+int binOpPrecedence[128];
+
+static bool initPrecedence = [] {
+  std::fill(std::begin(binOpPrecedence), std::end(binOpPrecedence), -1);
+  // 1 is lowest precedence
+  binOpPrecedence['='] = 2;
+  binOpPrecedence['<'] = 10;
+  binOpPrecedence['+'] = 20;
+  binOpPrecedence['-'] = 20;
+  binOpPrecedence['*'] = 40;
+  binOpPrecedence['/'] = 40;
+  return true;
+}();
+
+void installBinaryOperator(const PrototypeAST &proto) {
+  if (proto.isBinaryOp())
+    binOpPrecedence[proto.getOperatorName()] = proto.getBinaryPrecedence();
+}
 
 static int getTokPrecedence() {
   if (!isascii(curTok))
     return -1;
-  auto it = binOpPrecedence.find(curTok);
-  return it == binOpPrecedence.end() ? -1 : it->second;
+  return binOpPrecedence[curTok];
 }
 
-static std::unique_ptr<ExprAST> parseUnary() {
+static ExprAST *parseUnary() {
   if (!isascii(curTok) || curTok == '(' || curTok == ',')
     return parsePrimary();
 
@@ -272,12 +517,11 @@ static std::unique_ptr<ExprAST> parseUnary() {
   auto operand = parseUnary();
   LogDebug("parseUnary %c\n", (char)op);
   if (operand)
-    return std::make_unique<UnaryExprAST>(op, std::move(operand));
+    return arena->make<UnaryExprAST>(op, operand);
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> parseBinOpRhs(int exprPrec,
-                                              std::unique_ptr<ExprAST> lhs) {
+static ExprAST *parseBinOpRhs(int exprPrec, ExprAST *lhs) {
   while (true) {
     int tokPrec = getTokPrecedence();
     if (tokPrec < exprPrec)
@@ -292,23 +536,23 @@ static std::unique_ptr<ExprAST> parseBinOpRhs(int exprPrec,
     int nextPrec = getTokPrecedence();
     LogDebug("parseBinOpRhs: op %c(%d) prec %d\n", (char)binOp, binOp, tokPrec);
     if (tokPrec < nextPrec) {
-      rhs = parseBinOpRhs(tokPrec + 1, std::move(rhs));
+      rhs = parseBinOpRhs(tokPrec + 1, rhs);
       if (!rhs)
         return nullptr;
     }
-    lhs =
-        std::make_unique<BinaryExprAST>(binOp, std::move(lhs), std::move(rhs));
+    lhs = arena->make<BinaryExprAST>(binOp, lhs, rhs);
   }
 }
 
-static std::unique_ptr<ExprAST> parseExpr() {
+static ExprAST *parseExpr() {
   auto lhs = parseUnary();
   if (!lhs)
     return nullptr;
-  return parseBinOpRhs(0, std::move(lhs));
+  return parseBinOpRhs(0, lhs);
 }
 
-std::unique_ptr<PrototypeAST> parsePrototype() {
+// With allowArray, `name[]` declares a host array instead of a function.
+static PrototypeAST *parsePrototype(bool allowArray) {
   std::string fnName;
   unsigned kind = 0, binPrecedence = 30; // between +- & */
   switch (curTok) {
@@ -316,6 +560,15 @@ std::unique_ptr<PrototypeAST> parsePrototype() {
     fnName = identifierStr;
     kind = 0;
     getNextToken();
+    if (curTok == '[' && allowArray) {
+      if (getNextToken() != ']')
+        return LogErrorP("expected ']' in array declaration");
+      getNextToken();
+      auto proto = defArena.make<PrototypeAST>(symbols.intern(fnName),
+                                               ArrayRef<SymbolID>());
+      proto->setHostArray(true);
+      return proto;
+    }
     break;
   case tok_binary:
     getNextToken();
@@ -347,9 +600,22 @@ std::unique_ptr<PrototypeAST> parsePrototype() {
 
   if (curTok != '(')
     return LogErrorP("expected '(' in prototype");
-  std::vector<std::string> argNames;
-  while (getNextToken() == tok_identifier)
-    argNames.push_back(identifierStr);
+  SmallVector<SymbolID, 8> argNames;
+  uint64_t arrayArgs = 0;
+  getNextToken();
+  while (curTok == tok_identifier) {
+    argNames.push_back(symbols.intern(identifierStr));
+    if (getNextToken() != '[')
+      continue;
+    if (getNextToken() != ']')
+      return LogErrorP("expected ']' after '[' in array parameter");
+    if (kind)
+      return LogErrorP("operators cannot take arrays");
+    if (argNames.size() > 64)
+      return LogErrorP("only the first 64 parameters can be arrays");
+    arrayArgs |= uint64_t(1) << (argNames.size() - 1);
+    getNextToken();
+  }
 
   if (curTok != ')')
     return LogErrorP("expected ')' in prototype");
@@ -359,33 +625,51 @@ std::unique_ptr<PrototypeAST> parsePrototype() {
   if (kind && argNames.size() != kind)
     return LogErrorP("invalid number of operands for operator");
   LogDebug("parsePrototype %s(%d args)\n", fnName.c_str(), argNames.size());
-  return std::make_unique<PrototypeAST>(fnName, std::move(argNames), kind != 0,
-                                        binPrecedence);
+  auto proto = defArena.make<PrototypeAST>(symbols.intern(fnName),
+                                           defArena.copy<SymbolID>(argNames),
+                                           kind != 0, binPrecedence);
+  proto->setArrayArgs(arrayArgs);
+  return proto;
 }
 
-std::unique_ptr<FunctionAST> parseDefinition() {
+FunctionAST *parseDefinition() {
+  PhaseTimer timer(Phase::parse);
   getNextToken();
-  auto proto = parsePrototype();
+  bool fastMath = false, memo = false;
+  // qualifiers, in any order
+  while (curTok == tok_fastmath || curTok == tok_memo) {
+    (curTok == tok_fastmath ? fastMath : memo) = true;
+    getNextToken();
+  }
+  auto proto = parsePrototype(false);
   if (!proto)
     return nullptr;
+  proto->setFastMath(fastMath);
+  proto->setMemo(memo);
 
+  arena = &defArena;
   auto expr = parseExpr();
   if (!expr)
     return nullptr;
-  LogDebug("parseDefinition %s\n", proto->getName().c_str());
-  return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
+  LogDebug("parseDefinition %s\n", proto->getName().data());
+  return defArena.make<FunctionAST>(proto, expr);
 }
 
-std::unique_ptr<PrototypeAST> parseExtern() {
+PrototypeAST *parseExtern() {
+  PhaseTimer timer(Phase::parse);
   getNextToken();
-  return parsePrototype();
+  return parsePrototype(true);
 }
 
-std::unique_ptr<FunctionAST> parseTopLevelExpr() {
-  if (auto expr = parseExpr()) {
-    auto proto = std::make_unique<PrototypeAST>(ANON_EXPR_NAME,
-                                                std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
-  }
+FunctionAST *parseTopLevelExpr() {
+  PhaseTimer timer(Phase::parse);
+  // every top-level expression shares the same nullary prototype, which
+  // outlives any arena
+  static PrototypeAST anonProto(symbols.internPermanent(ANON_EXPR_NAME),
+                                ArrayRef<SymbolID>());
+
+  arena = &exprArena;
+  if (auto expr = parseExpr())
+    return exprArena.make<FunctionAST>(&anonProto, expr);
   return nullptr;
 }
@@ -30,13 +30,37 @@ enum Token {
 
   // variables
   tok_var = -13,
+
+  // function qualifiers
+  tok_fastmath = -14,
+  tok_memo = -15,
+
+  // arrays
+  tok_len = -16,
+
+  // parallel loops
+  tok_parfor = -17,
+  tok_reduce = -18,
 };
 extern int curTok;
 int getNextToken();
 
-extern std::map<char, int> binOpPrecedence;
+// Lex from a memory-mapped file instead of stdin; false if it can't be opened.
+bool setInputFile(const std::string &path);
+// Lex from an open file descriptor.
+void setInputFD(int fd);
+// Lex text, which must stay alive until it has been parsed. The next
+// getNextToken() returns its first token.
+void setInputBuffer(StringRef text);
+
+// precedence of each binary operator character, -1 if it isn't one
+extern int binOpPrecedence[128];
+// Make a user-defined binary operator parseable with its precedence. Called
+// when its definition is compiled (or registered, in tiered and bytecode mode).
+void installBinaryOperator(const PrototypeAST &proto);
 
-std::unique_ptr<FunctionAST> parseDefinition();
-std::unique_ptr<PrototypeAST> parseExtern();
-std::unique_ptr<FunctionAST> parseDefinition();
-std::unique_ptr<FunctionAST> parseTopLevelExpr();
\ No newline at end of file
+// Definitions and prototypes are allocated in defArena, top-level expressions
+// in exprArena, which the caller resets once they have been compiled.
+FunctionAST *parseDefinition();
+PrototypeAST *parseExtern();
+FunctionAST *parseTopLevelExpr();
\ No newline at end of file
@@ -1,21 +1,89 @@
 #include "codegen.h"
 #include "common.h"
 #include "parser.h"
+#include "stats.h"
+#include "tier.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+
+static cl::opt<std::string>
+    dumpIRFile("dump-ir",
+               cl::desc("Write the optimized IR of compiled functions to "
+                        "<file>, independent of -v"),
+               cl::value_desc("file"), cl::init(""));
+
+static cl::list<std::string>
+    dumpIRFuncs("dump-ir-func",
+                cl::desc("Only dump these functions with -dump-ir "
+                         "(comma-separated, default: all)"),
+                cl::value_desc("name"), cl::CommaSeparated);
 
 static ExitOnError exitOnError;
 
+// Call a compiled top-level expression, charging it to the exec phase.
+static double run(double (*fp)()) {
+  PhaseTimer timer(Phase::exec);
+  return fp();
+}
+
+// Append f's IR to the -dump-ir file if it was selected.
+static void dumpIR(const Function &f) {
+  static std::unique_ptr<raw_fd_ostream> out;
+  static StringSet<> selected = [] {
+    StringSet<> names;
+    for (auto &name : dumpIRFuncs)
+      names.insert(name);
+    return names;
+  }();
+  if (dumpIRFile.empty() || f.isDeclaration())
+    return;
+  if (!selected.empty() && !selected.contains(f.getName()))
+    return;
+  if (!out) {
+    std::error_code ec;
+    out = std::make_unique<raw_fd_ostream>(dumpIRFile, ec);
+    if (ec) {
+      errs() << "cannot open " << dumpIRFile << ": " << ec.message() << "\n";
+      dumpIRFile.setValue("");
+      return;
+    }
+  }
+  f.print(*out);
+  // complete while we run, for embedders that read it back
+  out->flush();
+}
+
+void showIR(const char *what, const Function &f) {
+  if (verbosity >= Verbosity::ir) {
+    LogInfo("%s:\n", what);
+    f.print(errs());
+    LogInfo("\n");
+  }
+  dumpIR(f);
+}
+
 static void handleDefinition() {
   if (auto FuncAST = parseDefinition()) {
-    if (auto *FuncIR = FuncAST->codegen()) {
-      LogInfo("function definition:\n");
-      FuncIR->print(errs());
-      LogInfo("\n");
+    if (tieredExecution()) {
+      tierDefine(FuncAST);
+    } else if (auto *FuncIR = FuncAST->codegen()) {
+      optimizeModule();
+      showIR("function definition", *FuncIR);
+      std::string name = FuncAST->getProto().getName().str();
       exitOnError(theJIT->addModule(
           orc::ThreadSafeModule(std::move(theModule), std::move(theContext))));
+      // compile on a worker while we parse ahead
+      if (backgroundCompile())
+        theJIT->prefetch(name);
       initModuleAndPassMgr();
+      // keep the body around so later definitions can inline it
+      functionDefs[FuncAST->getProto().getNameID()] = FuncAST;
     }
   } else {
     getNextToken(); // skip next token
@@ -24,44 +92,73 @@ static void handleDefinition() {
 
 static void handleExtern() {
   if (auto ProtoAST = parseExtern()) {
-    if (auto *FuncIR = ProtoAST->codegen()) {
-      LogInfo("extern function:\n");
-      FuncIR->print(errs());
-      LogInfo("\n");
-      functionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    if (ProtoAST->isHostArray()) {
+      hostArrays[ProtoAST->getNameID()] = ProtoAST;
+    } else if (auto *FuncIR = ProtoAST->codegen()) {
+      showIR("extern function", *FuncIR);
+      functionProtos[ProtoAST->getNameID()] = ProtoAST;
     }
   } else {
     getNextToken(); // skip next token
   }
 }
 
-static void handleTopLevelExpr() {
-  if (auto FuncAST = parseTopLevelExpr()) {
-    if (auto *FuncIR = FuncAST->codegen()) {
-      LogInfo("top level expression:\n");
-      FuncIR->print(errs());
-      LogInfo("\n");
-
-      auto rt = theJIT->getMainJITDylib().createResourceTracker();
-      auto tsm =
-          orc::ThreadSafeModule(std::move(theModule), std::move(theContext));
-      exitOnError(theJIT->addModule(std::move(tsm), rt));
-      initModuleAndPassMgr();
+// Compile a top-level expression into its own module, run it and drop it.
+static void runTopLevelExpr(FunctionAST *FuncAST) {
+  initExprModule();
+  auto *FuncIR = FuncAST->codegen();
+  if (!FuncIR) {
+    getNextToken(); // skip next token
+    return;
+  }
+  optimizeModule();
+  showIR("top level expression", *FuncIR);
 
-      // Search the JIT for the __anon_expr symbol.
-      auto exprSymbol = exitOnError(theJIT->lookup(ANON_EXPR_NAME));
-      assert(exprSymbol.getAddress() && "Function not found");
+  auto rt = theJIT->getMainJITDylib().createResourceTracker();
+  auto tsm = orc::ThreadSafeModule(std::move(theModule), std::move(theContext));
+  // the expression runs right away and only once: compile it eagerly,
+  // cheaply and without caching the object
+  exitOnError(theJIT->addExprModule(std::move(tsm), rt));
+  initModuleAndPassMgr();
 
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      double (*fp)() = exprSymbol.getAddress().toPtr<double (*)(void)>();
-      fprintf(stderr, "Evaluated to %f\n", fp());
+  // Search the JIT for the __anon_expr symbol.
+  auto exprSymbol = exitOnError(theJIT->lookup(ANON_EXPR_NAME));
+  assert(exprSymbol.getAddress() && "Function not found");
 
-      // Delete the anonymous expression module from the JIT.
-      exitOnError(rt->remove());
+  // Get the symbol's address and cast it to the right type (takes no
+  // arguments, returns a double) so we can call it as a native function.
+  double (*fp)() = exprSymbol.getAddress().toPtr<double (*)(void)>();
+  fprintf(stderr, "Evaluated to %f\n", run(fp));
+
+  // Delete the anonymous expression module from the JIT.
+  exitOnError(rt->remove());
+}
+
+static void handleTopLevelExpr() {
+  using Clock = std::chrono::steady_clock;
+  bool measure = stats::enabled();
+  auto start = measure ? Clock::now() : Clock::time_point();
+  if (auto FuncAST = parseTopLevelExpr()) {
+    if (auto val = FuncAST->getBody().fold()) {
+      // constant: answer it without building a module or touching the JIT
+      fprintf(stderr, "Evaluated to %f\n", *val);
+      stats::counters.exprsFolded++;
+    } else if (tieredExecution()) {
+      PhaseTimer timer(Phase::exec);
+      double val = tierEvaluate(*FuncAST);
+      fprintf(stderr, "Evaluated to %f\n", val);
     } else {
-      getNextToken(); // skip next token
+      runTopLevelExpr(FuncAST);
     }
+    // the expression's AST is dead once it has been compiled
+    exprArena.reset();
+  }
+  if (measure) {
+    stats::counters.exprs++;
+    stats::counters.exprNanos +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             start)
+            .count();
   }
 }
 
@@ -87,4 +184,79 @@ void mainLoop() {
       break;
     }
   }
-}
\ No newline at end of file
+}
+
+std::vector<Function *> codegenAll() {
+  std::vector<Function *> topLevel;
+  while (true) {
+    while (curTok == 0 || curTok == ';') // ignore top level semicolon
+      getNextToken();
+    switch (curTok) {
+    case tok_eof:
+      return topLevel;
+    case tok_def:
+      if (auto FuncAST = parseDefinition())
+        FuncAST->codegen();
+      else
+        getNextToken(); // skip next token
+      break;
+    case tok_extern:
+      if (auto ProtoAST = parseExtern()) {
+        if (ProtoAST->isHostArray()) {
+          hostArrays[ProtoAST->getNameID()] = ProtoAST;
+          break;
+        }
+        ProtoAST->codegen();
+        functionProtos[ProtoAST->getNameID()] = ProtoAST;
+      } else {
+        getNextToken(); // skip next token
+      }
+      break;
+    default:
+      if (auto FuncAST = parseTopLevelExpr()) {
+        // every expression becomes its own function in the shared module
+        if (auto *FuncIR = FuncAST->codegen()) {
+          FuncIR->setName(std::string(ANON_EXPR_NAME) + "." +
+                          std::to_string(topLevel.size()));
+          topLevel.push_back(FuncIR);
+        }
+        exprArena.reset();
+      } else {
+        getNextToken(); // skip next token
+      }
+      break;
+    }
+  }
+}
+
+void runBatch() {
+  std::vector<Function *> topLevel = codegenAll();
+  optimizeModule();
+  for (const Function &f : *theModule) {
+    if (f.isIntrinsic())
+      continue;
+    const char *what = f.isDeclaration() ? "extern function"
+                       : f.getName().startswith(ANON_EXPR_NAME)
+                           ? "top level expression"
+                           : "function definition";
+    showIR(what, f);
+  }
+
+  std::vector<std::string> names;
+  for (Function *f : topLevel)
+    names.push_back(f->getName().str());
+
+  // hand the whole program to the JIT in one go, and resolve every top-level
+  // expression before running any so compilation is timed separately
+  exitOnError(theJIT->addModule(
+      orc::ThreadSafeModule(std::move(theModule), std::move(theContext))));
+  initModuleAndPassMgr();
+  std::vector<double (*)()> exprs;
+  for (auto &name : names) {
+    auto exprSymbol = exitOnError(theJIT->lookup(name));
+    exprs.push_back(exprSymbol.getAddress().toPtr<double (*)(void)>());
+  }
+
+  for (auto *fp : exprs)
+    fprintf(stderr, "Evaluated to %f\n", run(fp));
+}
@@ -0,0 +1,258 @@
+// Runtime support functions callable from Kaleidoscope code. Linked into the
+// JIT driver (so the JIT can resolve them in-process) and archived into
+// libkalrt.a for executables produced by ahead-of-time compilation.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double x) {
+  fputc((char)x, stderr);
+  return 0;
+}
+
+/// printd - print double
+extern "C" DLLEXPORT double printd(double x) {
+  fprintf(stdout, "%f\n", x);
+  return 0;
+}
+
+typedef void (*KalErrorHandler)(const char *message);
+
+// Set by a host on a thread whose runtime errors should go back to it rather
+// than end the process (the sessions of -serve). It must not return.
+static thread_local KalErrorHandler errorHandler = nullptr;
+
+/// kal_set_error_handler - send this thread's runtime errors to handler, or
+/// abort on them again if it is null
+extern "C" DLLEXPORT void kal_set_error_handler(KalErrorHandler handler) {
+  errorHandler = handler;
+}
+
+// Report a runtime error to the thread's handler, or print it and abort.
+static void fail(const char *message) {
+  if (errorHandler)
+    errorHandler(message);
+  fputs(message, stderr);
+  fflush(stderr);
+  abort();
+}
+
+/// kal_index_error - called by compiled code for an array index out of bounds
+extern "C" DLLEXPORT void kal_index_error(double index, int64_t length) {
+  char message[96];
+  snprintf(message, sizeof(message),
+           "Error: array index %g out of bounds for length %lld\n", index,
+           (long long)length);
+  fail(message);
+}
+
+/// kal_array_new - zeroed storage for `var name[size]`
+extern "C" DLLEXPORT double *kal_array_new(double size) {
+  double *data = nullptr;
+  // also rejects NaN; 2^53 elements is more than any machine has anyway
+  if (size >= 0 && size <= 0x1p53)
+    data = (double *)calloc((size_t)size ? (size_t)size : 1, sizeof(double));
+  if (!data) {
+    char message[96];
+    snprintf(message, sizeof(message),
+             "Error: cannot allocate an array of %g elements\n", size);
+    fail(message);
+  }
+  return data;
+}
+
+/// kal_array_delete - free an array from kal_array_new
+extern "C" DLLEXPORT void kal_array_delete(double *data) { free(data); }
+
+//===----------------------------------------------------------------------===//
+// parfor
+//===----------------------------------------------------------------------===//
+//
+// kal_parfor runs chunk(env, c) for every c < chunks on a pool of threads,
+// the calling one included. Each thread starts with an even share of the
+// chunks, takes them from the front of its share, and once that is empty
+// steals the back half of another thread's. Loops started from inside a
+// chunk run sequentially on the thread that started them, and loops started
+// by two threads at once take turns. Only POSIX threads and libc are used,
+// so executables built with -o just need -pthread.
+
+typedef void (*ParforChunk)(void *env, int64_t chunk);
+
+namespace {
+// the chunks [next, end) a thread has yet to run
+struct Share {
+  pthread_mutex_t lock;
+  int64_t next, end;
+};
+
+struct Pool {
+  int threads = 0; // the callers of kal_parfor count as one
+  Share *shares = nullptr;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // guards the fields below
+  pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+  uint64_t generation = 0; // incremented for each loop
+  int busy = 0;            // workers still on the current loop
+  ParforChunk chunk = nullptr;
+  void *env = nullptr;
+};
+
+// clears the thread's error handler for as long as it lives
+struct NoErrorHandler {
+  KalErrorHandler saved = errorHandler;
+  NoErrorHandler() { errorHandler = nullptr; }
+  ~NoErrorHandler() { errorHandler = saved; }
+};
+} // namespace
+
+static Pool pool;
+// serializes loops started by different threads
+static pthread_mutex_t loopLock = PTHREAD_MUTEX_INITIALIZER;
+static int requestedThreads = 0;
+static thread_local bool inParfor = false;
+
+static int64_t takeChunk(Share &share) {
+  int64_t c = -1;
+  pthread_mutex_lock(&share.lock);
+  if (share.next < share.end)
+    c = share.next++;
+  pthread_mutex_unlock(&share.lock);
+  return c;
+}
+
+// Move the back half of another thread's share to thread self's; returns its
+// first chunk to run, or -1 if every share is empty.
+static int64_t stealChunk(int self) {
+  for (int i = 1; i < pool.threads; i++) {
+    Share &victim = pool.shares[(self + i) % pool.threads];
+    pthread_mutex_lock(&victim.lock);
+    int64_t left = victim.end - victim.next;
+    int64_t from = victim.end - (left + 1) / 2, to = victim.end;
+    if (left > 0)
+      victim.end = from;
+    pthread_mutex_unlock(&victim.lock);
+    if (left <= 0)
+      continue;
+    Share &own = pool.shares[self];
+    pthread_mutex_lock(&own.lock);
+    own.next = from + 1;
+    own.end = to;
+    pthread_mutex_unlock(&own.lock);
+    return from;
+  }
+  return -1;
+}
+
+static void runShare(int self, ParforChunk chunk, void *env) {
+  inParfor = true;
+  for (;;) {
+    int64_t c = takeChunk(pool.shares[self]);
+    if (c < 0 && (c = stealChunk(self)) < 0)
+      break;
+    chunk(env, c);
+  }
+  inParfor = false;
+}
+
+static void *worker(void *arg) {
+  int self = (int)(intptr_t)arg;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == seen)
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    seen = pool.generation;
+    ParforChunk chunk = pool.chunk;
+    void *env = pool.env;
+    pthread_mutex_unlock(&pool.lock);
+    runShare(self, chunk, env);
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.busy == 0)
+      pthread_cond_signal(&pool.done);
+  }
+  return nullptr;
+}
+
+// Start the workers on first use: kal_parfor_threads, else $KAL_THREADS,
+// else one thread per online CPU.
+static void startPool() {
+  int n = requestedThreads;
+  if (n <= 0) {
+    const char *env = getenv("KAL_THREADS");
+    n = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  pool.threads = n > 0 ? n : 1;
+  pool.shares = (Share *)calloc(pool.threads, sizeof(Share));
+  if (!pool.shares) {
+    fprintf(stderr, "Error: cannot allocate the parfor thread pool\n");
+    abort();
+  }
+  for (int i = 0; i < pool.threads; i++)
+    pthread_mutex_init(&pool.shares[i].lock, nullptr);
+  for (int i = 1; i < pool.threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, worker, (void *)(intptr_t)i)) {
+      // run with the workers we have
+      pool.threads = i;
+      break;
+    }
+    pthread_detach(thread);
+  }
+}
+
+/// kal_parfor_threads - number of threads for parfor loops, counting the
+/// caller's; only takes effect before the first loop runs
+extern "C" DLLEXPORT void kal_parfor_threads(int n) { requestedThreads = n; }
+
+/// kal_parfor - run chunk(env, c) for c in [0, chunks), in parallel
+extern "C" DLLEXPORT void kal_parfor(ParforChunk chunk, void *env,
+                                     int64_t chunks) {
+  if (chunks <= 0)
+    return;
+  // the pool can't be left in the middle of a loop, so errors in chunks
+  // abort even on the caller's thread
+  NoErrorHandler noHandler;
+  if (!inParfor) {
+    pthread_mutex_lock(&loopLock);
+    if (!pool.shares)
+      startPool();
+  }
+  if (inParfor || pool.threads == 1 || chunks == 1) {
+    if (!inParfor)
+      pthread_mutex_unlock(&loopLock);
+    for (int64_t c = 0; c < chunks; c++)
+      chunk(env, c);
+    return;
+  }
+
+  for (int i = 0; i < pool.threads; i++) {
+    pool.shares[i].next = chunks * i / pool.threads;
+    pool.shares[i].end = chunks * (i + 1) / pool.threads;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.chunk = chunk;
+  pool.env = env;
+  pool.busy = pool.threads - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  runShare(0, chunk, env);
+
+  // the shares and env must outlive every worker's last look at them
+  pthread_mutex_lock(&pool.lock);
+  while (pool.busy > 0)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&loopLock);
+}
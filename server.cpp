@@ -0,0 +1,375 @@
+#include "codegen.h"
+#include "common.h"
+#include "memo.h"
+#include "parser.h"
+#include "tier.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csetjmp>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+static cl::opt<std::string>
+    serveSocket("serve",
+                cl::desc("Serve sessions on the Unix socket <path>, sharing "
+                         "the definitions of the input between them"),
+                cl::value_desc("path"), cl::init(""));
+
+static ExitOnError exitOnError;
+
+// The parser, codegen and the pass managers keep their state in globals, so
+// sessions take turns to compile. Running compiled code needs no lock.
+static std::mutex compileLock;
+
+// What the compiler knows by name: prototypes, definitions it may inline,
+// host arrays and operator precedences. A session starts from a copy of the
+// library's and swaps it with the globals while it holds compileLock, so its
+// definitions are invisible to other sessions.
+struct Namespace {
+  SymbolMap<PrototypeAST *> protos = functionProtos;
+  SymbolMap<FunctionAST *> defs = functionDefs;
+  SymbolMap<PrototypeAST *> arrays = hostArrays;
+  std::array<int, 128> precedence;
+
+  Namespace() {
+    std::copy(std::begin(binOpPrecedence), std::end(binOpPrecedence),
+              precedence.begin());
+  }
+
+  void exchange() {
+    std::swap(protos, functionProtos);
+    std::swap(defs, functionDefs);
+    std::swap(arrays, hostArrays);
+    std::swap_ranges(precedence.begin(), precedence.end(), binOpPrecedence);
+  }
+};
+
+// One client connection. Its code goes into jd, which is layered over the
+// library in the main dylib and removed, with all its code, on disconnect.
+// The ASTs of its definitions, the names it interned and its memoized
+// functions are given back then too.
+struct Session {
+  int fd;
+  orc::JITDylib &jd;
+  Namespace ns;
+  ASTArena defs; // swapped with defArena while it compiles
+  DenseSet<SymbolID> names;
+  std::vector<std::string> memoized;
+  unsigned exprs = 0; // top-level expressions compiled so far
+
+  Session(int fd, orc::JITDylib &jd) : fd(fd), jd(jd) {}
+};
+
+// A top-level expression of a request: compiled into its own resource
+// tracker, or folded to value.
+struct PendingExpr {
+  std::string name;
+  orc::ResourceTrackerSP rt;
+  double value = 0;
+};
+
+static orc::ThreadSafeModule takeModule() {
+  return orc::ThreadSafeModule(std::move(theModule), std::move(theContext));
+}
+
+// Report err as a compile error of the request.
+static void logJITError(Error err) {
+  LogError(toString(std::move(err)).c_str());
+}
+
+static void compileDefinition(orc::ResourceTrackerSP &rt) {
+  if (auto FuncAST = parseDefinition()) {
+    if (FuncAST->codegen()) {
+      optimizeModule();
+      // fails if the session defined the function before
+      if (auto err = theJIT->addModule(takeModule(), rt))
+        logJITError(std::move(err));
+      else
+        functionDefs[FuncAST->getProto().getNameID()] = FuncAST;
+      initModuleAndPassMgr();
+    }
+  } else {
+    getNextToken(); // skip next token
+  }
+}
+
+static void compileExtern() {
+  if (auto ProtoAST = parseExtern()) {
+    if (ProtoAST->isHostArray()) {
+      hostArrays[ProtoAST->getNameID()] = ProtoAST;
+    } else if (ProtoAST->codegen()) {
+      functionProtos[ProtoAST->getNameID()] = ProtoAST;
+    }
+  } else {
+    getNextToken(); // skip next token
+  }
+}
+
+static void compileTopLevelExpr(Session &session,
+                                std::vector<PendingExpr> &exprs) {
+  if (auto FuncAST = parseTopLevelExpr()) {
+    if (auto val = FuncAST->getBody().fold()) {
+      exprs.push_back({"", nullptr, *val});
+    } else {
+      initExprModule();
+      if (auto *FuncIR = FuncAST->codegen()) {
+        // several expressions of one request live in the dylib at once
+        std::string name = std::string(ANON_EXPR_NAME) + "." +
+                           std::to_string(session.exprs++);
+        FuncIR->setName(name);
+        optimizeModule();
+        auto rt = session.jd.createResourceTracker();
+        if (auto err = theJIT->addExprModule(takeModule(), rt))
+          logJITError(std::move(err));
+        else
+          exprs.push_back({name, rt});
+        initModuleAndPassMgr();
+      }
+    }
+  } else {
+    getNextToken(); // skip next token
+  }
+  exprArena.reset();
+}
+
+// Compile every item of text in the session's namespace, up to the first
+// error. Definitions go into rt; expressions are only compiled, and the
+// caller runs them once compileLock is released.
+static void compileItems(Session &session, StringRef text,
+                         orc::ResourceTrackerSP &rt,
+                         std::vector<PendingExpr> &exprs) {
+  setInputBuffer(text);
+  getNextToken();
+  while (errorLog->empty()) {
+    while (curTok == ';') // ignore top level semicolon
+      getNextToken();
+    if (curTok == tok_eof)
+      break;
+    if (curTok == tok_def)
+      compileDefinition(rt);
+    else if (curTok == tok_extern)
+      compileExtern();
+    else
+      compileTopLevelExpr(session, exprs);
+  }
+}
+
+// Compile text for the session. Errors are reported in errors rather than
+// ending the server, and drop the whole request: what it added to the JIT is
+// removed, and the session's namespace is left as it was before.
+static std::vector<PendingExpr> compileRequest(Session &session,
+                                               StringRef text,
+                                               std::string &errors) {
+  std::vector<PendingExpr> exprs;
+  std::lock_guard<std::mutex> lock(compileLock);
+  session.ns.exchange();
+  std::swap(session.defs, defArena);
+  symbols.record(&session.names);
+  Namespace before; // a copy of the session's
+  size_t memoBefore = memoizedFunctions().size();
+  auto rt = session.jd.createResourceTracker();
+  errorLog = &errors;
+  compileItems(session, text, rt, exprs);
+  errorLog = nullptr;
+  std::vector<std::string> memoized(memoizedFunctions().begin() + memoBefore,
+                                    memoizedFunctions().end());
+  if (errors.empty()) {
+    rt->transferTo(*session.jd.getDefaultResourceTracker());
+    session.memoized.insert(session.memoized.end(), memoized.begin(),
+                            memoized.end());
+  } else {
+    forgetMemoized(memoized);
+    // the module of the item that failed is half built
+    theModule.reset();
+    initModuleAndPassMgr();
+    exprArena.reset();
+    exitOnError(rt->remove());
+    for (auto &expr : exprs)
+      if (expr.rt)
+        exitOnError(expr.rt->remove());
+    exprs.clear();
+    before.exchange();
+  }
+  symbols.record(nullptr);
+  std::swap(session.defs, defArena);
+  session.ns.exchange();
+  return exprs;
+}
+
+static void reply(Session &session, StringRef line) {
+  // a client that went away must not take the server down with SIGPIPE
+  send(session.fd, line.data(), line.size(), MSG_NOSIGNAL);
+}
+
+// Where a runtime error in the code a session runs takes its thread back
+// to, and its message. Only runtime code and compiled code, which have
+// nothing to clean up, lie in between.
+static thread_local jmp_buf runTrap;
+static thread_local std::string runError;
+
+static void trapRuntimeError(const char *message) {
+  runError = message;
+  longjmp(runTrap, 1);
+}
+
+// Store what fp returns in value; false if it ran into a runtime error.
+static bool runTrapped(double (*fp)(), double &value) {
+  if (setjmp(runTrap))
+    return false;
+  value = fp();
+  return true;
+}
+
+// Run the expressions in order and send their values to the client. Each is
+// looked up here, so it is compiled on this thread, and removed after it ran.
+// A runtime error is sent instead, and the rest of the request is dropped.
+static void runRequest(Session &session, std::vector<PendingExpr> &exprs) {
+  bool failed = false;
+  for (auto &expr : exprs) {
+    if (expr.rt) {
+      if (!failed) {
+        auto sym = exitOnError(theJIT->lookup(session.jd, expr.name));
+        failed =
+            !runTrapped(sym.getAddress().toPtr<double (*)()>(), expr.value);
+        if (failed)
+          reply(session, runError);
+      }
+      exitOnError(expr.rt->remove());
+    }
+    if (failed)
+      continue;
+    char line[64];
+    int len = snprintf(line, sizeof(line), "Evaluated to %f\n", expr.value);
+    reply(session, StringRef(line, std::min<size_t>(len, sizeof(line) - 1)));
+  }
+}
+
+// End of the last complete item in text: just past its last ';' outside a
+// comment, or 0 if there is none yet.
+static size_t completeItems(StringRef text) {
+  size_t end = 0;
+  bool comment = false;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (comment)
+      comment = c != '\n' && c != '\r';
+    else if (c == '#')
+      comment = true;
+    else if (c == ';')
+      end = i + 1;
+  }
+  return end;
+}
+
+static void runSession(int fd, unsigned id) {
+  std::unique_ptr<Session> session;
+  {
+    std::lock_guard<std::mutex> lock(compileLock);
+    std::string name = "session." + std::to_string(id);
+    session = std::make_unique<Session>(
+        fd, theJIT->createSessionJITDylib(name));
+  }
+  LogInfo("session %u connected\n", id);
+  kal_set_error_handler(trapRuntimeError);
+
+  // items are compiled as soon as a ';' completes them, and the rest of the
+  // input when the client shuts down its end
+  std::string input;
+  char buf[4096];
+  bool done = false;
+  while (!done) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n > 0)
+      input.append(buf, n);
+    else
+      done = true;
+    size_t end = done ? input.size() : completeItems(input);
+    if (!end)
+      continue;
+    std::string text = input.substr(0, end);
+    input.erase(0, end);
+    std::string errors;
+    auto exprs = compileRequest(*session, text, errors);
+    if (!errors.empty()) {
+      // the session goes on with the next request
+      reply(*session, errors);
+      LogInfo("session %u: request dropped\n", id);
+      continue;
+    }
+    runRequest(*session, exprs);
+  }
+
+  close(fd);
+  exitOnError(theJIT->removeJITDylib(session->jd));
+  {
+    // with its code gone, nothing refers to the session's ASTs and names
+    std::lock_guard<std::mutex> lock(compileLock);
+    symbols.release(session->names);
+    forgetMemoized(session->memoized);
+    session.reset();
+  }
+  LogInfo("session %u closed\n", id);
+}
+
+bool serving() { return !serveSocket.empty(); }
+
+int serve(bool hasLibrary) {
+  if (tieredExecution()) {
+    errs() << "-serve does not support -tiered\n";
+    return 1;
+  }
+  if (hasLibrary)
+    mainLoop();
+  // sessions run library code in parallel, and a memo cache is not safe to
+  // share between threads
+  if (!memoizedFunctions().empty()) {
+    errs() << "-serve: the library memoizes " << memoizedFunctions().front()
+           << ", but memo caches are not thread-safe; drop memo (or "
+              "-auto-memo) from the library\n";
+    return 1;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (serveSocket.size() >= sizeof(addr.sun_path)) {
+    errs() << "socket path too long: " << serveSocket << "\n";
+    return 1;
+  }
+  strcpy(addr.sun_path, serveSocket.c_str());
+  unlink(addr.sun_path);
+  int listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFD < 0 || bind(listenFD, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listenFD, SOMAXCONN) < 0) {
+    errs() << "cannot listen on " << serveSocket << ": " << strerror(errno)
+           << "\n";
+    return 1;
+  }
+  LogInfo("serving on %s\n", serveSocket.c_str());
+
+  for (unsigned id = 0;; id++) {
+    int fd = accept(listenFD, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      errs() << "accept failed: " << strerror(errno) << "\n";
+      close(listenFD);
+      return 1;
+    }
+    std::thread(runSession, fd, id).detach();
+  }
+}
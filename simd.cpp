@@ -0,0 +1,292 @@
+#include "simd.h"
+#include "codegen.h"
+#include "common.h"
+#include "memo.h"
+
+#include <string>
+#include <utility>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+static cl::opt<unsigned> simdWidth(
+    "simd-width",
+    cl::desc("Widest vector variant emitted for each pure function, so loops "
+             "calling it can be vectorized (0 = none, default = 8)"),
+    cl::init(8));
+
+// the powers of two from 2 up to -simd-width
+static SmallVector<unsigned, 4> variantWidths() {
+  SmallVector<unsigned, 4> widths;
+  for (unsigned width = 2; width <= simdWidth; width *= 2)
+    widths.push_back(width);
+  return widths;
+}
+
+// f's variant for width lanes in f's module, declared if it isn't there yet
+static Function *getVariant(Function *f, unsigned width) {
+  std::string name = (f->getName() + ".v" + Twine(width)).str();
+  if (Function *v = f->getParent()->getFunction(name))
+    return v;
+  auto *vecTy = FixedVectorType::get(f->getReturnType(), width);
+  SmallVector<Type *, 4> params(f->arg_size(), vecTy);
+  return Function::Create(FunctionType::get(vecTy, params, false),
+                          Function::ExternalLinkage, name, f->getParent());
+}
+
+// libm functions LLVM has an operation for, and how many arguments they take;
+// not_intrinsic stands for frem, which is fmod
+static const std::pair<Intrinsic::ID, unsigned> *getMathOp(SymbolID callee) {
+  static const StringMap<std::pair<Intrinsic::ID, unsigned>> ops = {
+      {"sin", {Intrinsic::sin, 1}},     {"cos", {Intrinsic::cos, 1}},
+      {"exp", {Intrinsic::exp, 1}},     {"exp2", {Intrinsic::exp2, 1}},
+      {"log", {Intrinsic::log, 1}},     {"log2", {Intrinsic::log2, 1}},
+      {"log10", {Intrinsic::log10, 1}}, {"sqrt", {Intrinsic::sqrt, 1}},
+      {"fabs", {Intrinsic::fabs, 1}},   {"floor", {Intrinsic::floor, 1}},
+      {"ceil", {Intrinsic::ceil, 1}},   {"round", {Intrinsic::round, 1}},
+      {"trunc", {Intrinsic::trunc, 1}}, {"pow", {Intrinsic::pow, 2}},
+      {"fmin", {Intrinsic::minnum, 2}}, {"fmax", {Intrinsic::maxnum, 2}},
+      {"fmod", {Intrinsic::not_intrinsic, 2}}};
+  // only the externs: a definition of the same name is the script's own
+  PrototypeAST *proto = functionProtos.lookup(callee);
+  if (!proto || proto->isAnalyzed() || functionDefs.lookup(callee))
+    return nullptr;
+  auto it = ops.find(symbols.getName(callee));
+  return it == ops.end() ? nullptr : &it->second;
+}
+
+Value *emitMathCall(SymbolID callee, ArrayRef<Value *> args) {
+  auto *op = getMathOp(callee);
+  if (!op || op->second != args.size())
+    return nullptr;
+  if (op->first == Intrinsic::not_intrinsic)
+    return Builder->CreateFRem(args[0], args[1], "fmodtmp");
+  if (op->second == 1)
+    return Builder->CreateUnaryIntrinsic(op->first, args[0]);
+  return Builder->CreateBinaryIntrinsic(op->first, args[0], args[1]);
+}
+
+bool prepareSimd(const FunctionAST &def, bool vectorizing) {
+  const PrototypeAST &proto = def.getProto();
+  // Variants are only for code that leaves memory alone, which rules out
+  // memo caches, callers' included, and the libm functions that set errno.
+  // Every callee must be a libm function emitted as an LLVM operation, or a
+  // function with variants, which leaves memory alone for the same reasons.
+  bool readNone = true;
+  def.getBody().forEachCallee([&](SymbolID callee) {
+    PrototypeAST *calleeProto = functionProtos.lookup(callee);
+    readNone &= getMathOp(callee) || (calleeProto && calleeProto->isSimd());
+  });
+  // The variants' names go into a comma-separated attribute, each followed
+  // by the variant's name in parentheses.
+  bool simd = vectorizing && simdWidth >= 2 && isPure(proto.getNameID()) &&
+              readNone && !proto.isMemo() && !proto.isMemoCaller() &&
+              !proto.hasArrayArgs() && !proto.getArgs().empty() &&
+              proto.getName().find_first_of("(),") == StringRef::npos;
+  return simd;
+}
+
+void declareSimdVariants(Function *f) {
+  // VFABI::MappingsAttrName
+  static const char *mappingsAttr = "vector-function-abi-variant";
+  if (f->hasFnAttribute(mappingsAttr))
+    return;
+  Module &m = *f->getParent();
+  std::string mappings;
+  SmallVector<GlobalValue *, 4> variants;
+  for (unsigned width : variantWidths()) {
+    Function *v = getVariant(f, width);
+    std::string name = v->getName().str();
+    v->setDoesNotAccessMemory();
+    v->setDoesNotThrow();
+    variants.push_back(v);
+    // _ZGV <ISA> <unmasked> <lanes> <a vector per parameter> _ <scalar name>
+    if (!mappings.empty())
+      mappings += ",";
+    mappings += "_ZGV_LLVM_N" + std::to_string(width) +
+                std::string(f->arg_size(), 'v') + "_" + f->getName().str() +
+                "(" + name + ")";
+  }
+  f->addFnAttr(mappingsAttr, mappings);
+  // The vectorizer only widens calls that leave memory alone, and
+  // prepareSimd made sure f does.
+  f->setDoesNotAccessMemory();
+  f->setDoesNotThrow();
+  // keep the declarations around until the vectorizer has looked for them
+  appendToCompilerUsed(m, variants);
+}
+
+// The variables of the variant being emitted, bound to vectors of their
+// values in every lane. Variables are never assigned in a variant, so they
+// need no stack slots.
+class SimdScope {
+  SmallVector<std::pair<SymbolID, Value *>, 8> vars; // innermost last
+
+public:
+  unsigned width;
+  FixedVectorType *type; // <width x double>
+
+  SimdScope(unsigned width)
+      : width(width), type(FixedVectorType::get(Builder->getDoubleTy(),
+                                                width)) {}
+
+  Value *lookup(SymbolID name) const {
+    for (auto it = vars.rbegin(); it != vars.rend(); ++it)
+      if (it->first == name)
+        return it->second;
+    return nullptr;
+  }
+  void bind(SymbolID name, Value *v) { vars.push_back({name, v}); }
+  size_t depth() const { return vars.size(); }
+  void popTo(size_t depth) { vars.resize(depth); }
+};
+
+// A call of a function with variants goes to its variant of the same width.
+// f's own variants are unfinished (and a recursion would never stop, as both
+// sides of an if are evaluated), so calls of f fail here.
+static Value *callVariant(SimdScope &scope, SymbolID callee,
+                          ArrayRef<Value *> args) {
+  PrototypeAST *proto = functionProtos.lookup(callee);
+  if (!proto || !proto->isSimd() || proto->getArgs().size() != args.size())
+    return nullptr;
+  Function *f = getCallee(callee);
+  if (!f)
+    return nullptr;
+  return Builder->CreateCall(getVariant(f, scope.width), args, "vcall");
+}
+
+bool emitSimdVariants(const FunctionAST &def, Function *f) {
+  const PrototypeAST &proto = def.getProto();
+  IRBuilderBase::InsertPointGuard guard(*Builder);
+  IRBuilderBase::FastMathFlagGuard fmfGuard(*Builder);
+  // as fast as f's own body
+  if (f->getFnAttribute("unsafe-fp-math").getValueAsBool()) {
+    FastMathFlags fmf;
+    fmf.setFast();
+    Builder->setFastMathFlags(fmf);
+  }
+
+  SmallVector<Function *, 4> variants;
+  for (unsigned width : variantWidths()) {
+    Function *v = getVariant(f, width);
+    variants.push_back(v);
+    for (const Attribute &attr : f->getAttributes().getFnAttrs())
+      if (attr.isStringAttribute())
+        v->addFnAttr(attr);
+    SimdScope scope(width);
+    for (unsigned i = 0; i < f->arg_size(); i++) {
+      v->getArg(i)->setName(f->getArg(i)->getName());
+      scope.bind(proto.getArgs()[i], v->getArg(i));
+    }
+    Builder->SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", v));
+    Value *result = def.getBody().codegenSimd(scope);
+    if (!result) {
+      // Calling f once per lane would be slower than the scalar loop the
+      // vectorizer falls back to, so f gets no variants at all.
+      for (Function *variant : variants)
+        variant->eraseFromParent();
+      return false;
+    }
+    Builder->CreateRet(result);
+    verifyFunction(*v);
+  }
+  const_cast<PrototypeAST &>(proto).setSimd(true);
+  declareSimdVariants(f);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// ExprAST::codegenSimd
+//===----------------------------------------------------------------------===//
+//
+// The same operations as codegen, lane by lane, so every lane computes what f
+// would. An if evaluates both sides and selects; that is safe because the
+// code is pure and floating-point operations don't trap. Loops, assignments,
+// arrays and calls of anything without variants have no vector form.
+
+Value *NumberExprAST::codegenSimd(SimdScope &scope) const {
+  return ConstantFP::get(scope.type, val);
+}
+
+Value *VariableExprAST::codegenSimd(SimdScope &scope) const {
+  return scope.lookup(name);
+}
+
+Value *VarExprAST::codegenSimd(SimdScope &scope) const {
+  size_t depth = scope.depth();
+  for (const auto &[name, init] : varNames) {
+    Value *v = init ? init->codegenSimd(scope)
+                    : ConstantFP::get(scope.type, 0.0);
+    if (!v)
+      return nullptr;
+    scope.bind(name, v);
+  }
+  Value *v = body->codegenSimd(scope);
+  scope.popTo(depth);
+  return v;
+}
+
+Value *UnaryExprAST::codegenSimd(SimdScope &scope) const {
+  Value *v = operand->codegenSimd(scope);
+  if (!v)
+    return nullptr;
+  return callVariant(scope, operatorSymbol(false, op), v);
+}
+
+Value *BinaryExprAST::codegenSimd(SimdScope &scope) const {
+  if (op == '=')
+    return nullptr;
+  Value *l = lhs->codegenSimd(scope);
+  if (!l)
+    return nullptr;
+  Value *r = rhs->codegenSimd(scope);
+  if (!r)
+    return nullptr;
+  switch (op) {
+  case '+':
+    return Builder->CreateFAdd(l, r, "addtmp");
+  case '-':
+    return Builder->CreateFSub(l, r, "subtmp");
+  case '*':
+    return Builder->CreateFMul(l, r, "multmp");
+  case '/':
+    return Builder->CreateFDiv(l, r, "divtmp");
+  case '<':
+    return Builder->CreateUIToFP(Builder->CreateFCmpULT(l, r, "cmptmp"),
+                                 scope.type, "booltmp");
+  default:
+    return callVariant(scope, operatorSymbol(true, op), {l, r});
+  }
+}
+
+Value *CallExprAST::codegenSimd(SimdScope &scope) const {
+  SmallVector<Value *, 4> argVs;
+  for (ExprAST *arg : args) {
+    argVs.push_back(arg->codegenSimd(scope));
+    if (!argVs.back())
+      return nullptr;
+  }
+  if (Value *v = emitMathCall(callee, argVs))
+    return v;
+  return callVariant(scope, callee, argVs);
+}
+
+Value *IfExprAST::codegenSimd(SimdScope &scope) const {
+  Value *c = cond->codegenSimd(scope);
+  if (!c)
+    return nullptr;
+  Value *t = then_->codegenSimd(scope);
+  if (!t)
+    return nullptr;
+  Value *e = else_->codegenSimd(scope);
+  if (!e)
+    return nullptr;
+  c = Builder->CreateFCmpONE(c, ConstantFP::get(scope.type, 0.0), "ifcond");
+  return Builder->CreateSelect(c, t, e, "iftmp");
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm/IR/Function.h"
+
+// Vector variants of pure functions. A pure function f(x y) compiled at -O2
+// or above also gets `<N x double> f.vN(<N x double>, <N x double>)` for
+// N = 2, 4, ... up to -simd-width, announced to LLVM through the vector
+// function ABI, so the loop vectorizer can widen calls to f that it couldn't
+// inline rather than give up on the loop. The variants are vector code
+// generated from f's body, so only straight-line bodies get them: arithmetic,
+// comparisons, var, if (as a select), calls of libm functions LLVM has vector
+// forms of and calls of functions with variants. User-defined operators are
+// functions too and get variants the same way.
+
+// Emit the LLVM operation for a call of callee, if callee is a libm extern
+// LLVM has one for (sin, sqrt, pow, fmod, ...) and args match it; otherwise
+// emit nothing and return null. Unlike the libm function, the operation
+// doesn't set errno, so the code calling it may leave memory alone. args may
+// be vectors.
+Value *emitMathCall(SymbolID callee, ArrayRef<Value *> args);
+
+// Decide whether def may get vector variants; vectorizing tells whether the
+// module its body went into is vectorized at all. Must run after prepareMemo.
+bool prepareSimd(const FunctionAST &def, bool vectorizing);
+
+// Declare the variants of f, whose prototype is marked, in f's module.
+void declareSimdVariants(Function *f);
+
+// Define the variants of f, whose body def has just been emitted, and mark
+// its prototype. If the body has no vector form, f gets no variants and
+// false is returned.
+bool emitSimdVariants(const FunctionAST &def, Function *f);
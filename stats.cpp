@@ -0,0 +1,161 @@
+#include "stats.h"
+
+#include <iterator>
+#include <sys/resource.h>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+enum class StatsFormat { none, table, json };
+
+// not -stats: LLVM registers that one for its own statistics
+static cl::opt<StatsFormat> statsFormat(
+    "pipeline-stats",
+    cl::desc("Report per-phase times and counters at exit"),
+    cl::values(clEnumValN(StatsFormat::none, "none", "No report (default)"),
+               clEnumValN(StatsFormat::table, "table", "Human-readable table"),
+               clEnumValN(StatsFormat::json, "json",
+                          "One JSON object, for tracking across releases")),
+    cl::init(StatsFormat::none));
+
+static cl::opt<bool> reportTime("time",
+                                cl::desc("Same as -pipeline-stats=table"),
+                                cl::init(false));
+
+static const char *phaseNames[] = {"lex",     "parse", "codegen", "optimize",
+                                   "compile", "link",  "exec"};
+static_assert(std::size(phaseNames) == (size_t)Phase::count);
+
+static std::atomic<int64_t> phaseNanos[(size_t)Phase::count];
+static const auto startTime = std::chrono::steady_clock::now();
+
+namespace stats {
+
+Counters counters;
+
+bool enabled() { return statsFormat != StatsFormat::none || reportTime; }
+
+void addTime(Phase phase, std::chrono::nanoseconds time) {
+  phaseNanos[(size_t)phase] += time.count();
+}
+
+// peak resident set size in bytes
+static uint64_t peakRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+void report() {
+  if (!enabled())
+    return;
+  double totalMs = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - startTime)
+                       .count();
+  std::pair<const char *, uint64_t> values[] = {
+      {"functions", counters.functions},
+      {"insts_before_opt", counters.instsBefore},
+      {"insts_after_opt", counters.instsAfter},
+      {"modules", counters.modules},
+      {"object_bytes", counters.objectBytes},
+      {"jit_memory_bytes", counters.jitMemory},
+      {"ast_nodes", counters.astNodes},
+      {"ast_bytes", counters.astBytes},
+      {"exprs", counters.exprs},
+      {"exprs_folded", counters.exprsFolded},
+      {"tier_promotions", counters.promotions},
+      {"memo_hits", counters.memoHits},
+      {"memo_misses", counters.memoMisses},
+      {"expr_latency_ns", counters.exprs
+                              ? counters.exprNanos / counters.exprs
+                              : 0},
+      {"peak_rss_bytes", peakRSS()},
+  };
+
+  raw_ostream &os = errs();
+  if (statsFormat == StatsFormat::json) {
+    os << "{\"phases_ms\": {";
+    for (size_t i = 0; i < (size_t)Phase::count; i++)
+      os << (i ? ", " : "") << '"' << phaseNames[i]
+         << "\": " << format("%.3f", phaseNanos[i] / 1e6);
+    os << "}, \"total_ms\": " << format("%.3f", totalMs);
+    for (auto &[name, value] : values)
+      os << ", \"" << name << "\": " << value;
+    os << "}\n";
+    return;
+  }
+
+  os << "phase         time (ms)\n";
+  for (size_t i = 0; i < (size_t)Phase::count; i++)
+    os << format("%-10s %12.3f\n", phaseNames[i], phaseNanos[i] / 1e6);
+  os << format("%-10s %12.3f\n", (const char *)"total", totalMs);
+  os << "\n";
+  for (auto &[name, value] : values)
+    os << format("%-18s %12llu\n", name, (unsigned long long)value);
+}
+
+} // namespace stats
+
+thread_local PhaseTimer *PhaseTimer::current = nullptr;
+
+PhaseTimer::PhaseTimer(Phase phase) : phase(phase), active(stats::enabled()) {
+  if (!active)
+    return;
+  start = Clock::now();
+  parent = current;
+  if (parent)
+    stats::addTime(parent->phase, start - parent->start);
+  current = this;
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!active)
+    return;
+  auto now = Clock::now();
+  stats::addTime(phase, now - start);
+  current = parent;
+  if (parent)
+    parent->start = now; // resume
+}
+
+Expected<std::unique_ptr<MemoryBuffer>> TimedIRCompiler::operator()(Module &M) {
+  PhaseTimer timer(Phase::compile);
+  auto obj = (*inner)(M);
+  if (obj) {
+    stats::counters.modules++;
+    stats::counters.objectBytes += (*obj)->getBufferSize();
+  }
+  return obj;
+}
+
+void TimedObjectLinkingLayer::emit(
+    std::unique_ptr<orc::MaterializationResponsibility> R,
+    std::unique_ptr<MemoryBuffer> O) {
+  PhaseTimer timer(Phase::link);
+  RTDyldObjectLinkingLayer::emit(std::move(R), std::move(O));
+}
+
+uint8_t *CountingMemoryManager::allocateCodeSection(uintptr_t Size,
+                                                    unsigned Alignment,
+                                                    unsigned SectionID,
+                                                    StringRef SectionName) {
+  stats::counters.jitMemory += Size;
+  return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                   SectionName);
+}
+
+uint8_t *CountingMemoryManager::allocateDataSection(uintptr_t Size,
+                                                    unsigned Alignment,
+                                                    unsigned SectionID,
+                                                    StringRef SectionName,
+                                                    bool IsReadOnly) {
+  stats::counters.jitMemory += Size;
+  return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID,
+                                                   SectionName, IsReadOnly);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+using namespace llvm;
+
+// Pipeline statistics, collected when -pipeline-stats (or -time) is given and
+// reported at exit. Phase times are exclusive: while a nested phase runs (the
+// lexer called from the parser, say) the enclosing one is paused, so the
+// phases add up to the time spent in the pipeline. Compile and link run on
+// the JIT's threads, so with -jit-threads they can exceed wall-clock time.
+enum class Phase { lex, parse, codegen, optimize, compile, link, exec, count };
+
+namespace stats {
+
+bool enabled();
+
+struct Counters {
+  std::atomic<uint64_t> functions{0};   // definitions and top-level exprs
+  std::atomic<uint64_t> instsBefore{0}; // IR instructions before optimizing
+  std::atomic<uint64_t> instsAfter{0};  // ... and after
+  std::atomic<uint64_t> modules{0};     // modules compiled to objects
+  std::atomic<uint64_t> objectBytes{0}; // object code emitted or loaded
+  std::atomic<uint64_t> jitMemory{0};   // bytes allocated for JIT'd sections
+  std::atomic<uint64_t> astNodes{0};
+  std::atomic<uint64_t> astBytes{0};
+  std::atomic<uint64_t> exprs{0};     // top-level expressions evaluated
+  std::atomic<uint64_t> exprsFolded{0}; // ... of which without the JIT
+  std::atomic<uint64_t> exprNanos{0}; // end to end, parse to result
+  std::atomic<uint64_t> promotions{0}; // functions moved up from tier 0
+  std::atomic<uint64_t> memoHits{0};   // calls answered from memo caches
+  std::atomic<uint64_t> memoMisses{0}; // ... and calls that ran the body
+};
+extern Counters counters;
+
+void addTime(Phase phase, std::chrono::nanoseconds time);
+
+// Print the summary in the format selected on the command line, if any.
+void report();
+
+} // namespace stats
+
+// Charges the time until it goes out of scope to a phase. Does nothing (not
+// even read the clock) unless statistics are enabled.
+class PhaseTimer {
+  using Clock = std::chrono::steady_clock;
+
+  Phase phase;
+  bool active;
+  PhaseTimer *parent = nullptr;
+  Clock::time_point start;
+
+  static thread_local PhaseTimer *current;
+
+public:
+  explicit PhaseTimer(Phase phase);
+  ~PhaseTimer();
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+// IR compiler wrapper for the JIT's compile layer: times machine code
+// generation and counts the objects it produces.
+class TimedIRCompiler : public orc::IRCompileLayer::IRCompiler {
+  std::unique_ptr<orc::IRCompileLayer::IRCompiler> inner;
+
+public:
+  TimedIRCompiler(std::unique_ptr<orc::IRCompileLayer::IRCompiler> inner)
+      : IRCompiler(inner->getManglingOptions()), inner(std::move(inner)) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override;
+};
+
+// Object linking layer that times loading and relocating each object.
+class TimedObjectLinkingLayer : public orc::RTDyldObjectLinkingLayer {
+public:
+  using RTDyldObjectLinkingLayer::RTDyldObjectLinkingLayer;
+
+  void emit(std::unique_ptr<orc::MaterializationResponsibility> R,
+            std::unique_ptr<MemoryBuffer> O) override;
+};
+
+// Memory manager that counts the bytes allocated for JIT'd code and data.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override;
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override;
+};
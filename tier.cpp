@@ -0,0 +1,284 @@
+#include "tier.h"
+#include "codegen.h"
+#include "common.h"
+#include "memo.h"
+#include "parser.h"
+#include "stats.h"
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+
+static cl::opt<bool>
+    tiered("tiered",
+           cl::desc("Interpret functions until they are hot, then compile "
+                    "them in the background"),
+           cl::init(false));
+
+static cl::opt<unsigned> tierThreshold(
+    "tier-threshold",
+    cl::desc("Calls plus loop iterations after which an interpreted function "
+             "is compiled (default = 1000)"),
+    cl::init(1000));
+
+static ExitOnError exitOnError;
+
+struct TierEntry {
+  SymbolID name;
+  FunctionAST *def = nullptr; // null for externs
+  unsigned hotness = 0;       // calls plus loop iterations in tier 0
+  bool compiled = false;      // handed to the JIT
+  std::atomic<void *> native{nullptr}; // machine code, once it is ready
+};
+
+// entries never move: the JIT's callbacks hold on to them
+static std::deque<TierEntry> entries;
+static SymbolMap<TierEntry *> tierTable;
+
+static TierEntry &getEntry(SymbolID name) {
+  TierEntry *&e = tierTable[name];
+  if (!e) {
+    e = &entries.emplace_back();
+    e->name = name;
+  }
+  return *e;
+}
+
+class InterpFrame {
+  // innermost binding last
+  SmallVector<std::pair<SymbolID, double>, 8> vars;
+
+public:
+  TierEntry *fn; // function being interpreted, null at top level
+
+  explicit InterpFrame(TierEntry *fn) : fn(fn) {}
+
+  double *lookup(SymbolID name) {
+    for (auto it = vars.rbegin(), end = vars.rend(); it != end; ++it)
+      if (it->first == name)
+        return &it->second;
+    return nullptr;
+  }
+  void bind(SymbolID name, double val) { vars.emplace_back(name, val); }
+  size_t pushScope() const { return vars.size(); }
+  void popScope(size_t scope) { vars.resize(scope); }
+};
+
+bool tieredExecution() { return tiered; }
+
+// Compile e and every callee that is still interpreted into one module, and
+// switch them to machine code once the JIT has finished.
+static void promote(TierEntry &e) {
+  if (e.compiled)
+    return;
+  std::vector<TierEntry *> batch = {&e};
+  e.compiled = true;
+  e.def->codegen();
+  // machine code calls its callees directly, so they have to be compiled too;
+  // each one may add declarations for further callees
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Function &f : *theModule) {
+      if (!f.isDeclaration() || f.isIntrinsic())
+        continue;
+      TierEntry *callee = tierTable.lookup(symbols.intern(f.getName()));
+      if (!callee || !callee->def || callee->compiled)
+        continue;
+      callee->compiled = true;
+      batch.push_back(callee);
+      callee->def->codegen();
+      changed = true;
+      break;
+    }
+  }
+  optimizeModule();
+  exitOnError(theJIT->addModule(
+      orc::ThreadSafeModule(std::move(theModule), std::move(theContext))));
+  initModuleAndPassMgr();
+
+  std::vector<std::string> names;
+  for (TierEntry *c : batch) {
+    functionDefs[c->name] = c->def; // later modules may inline it now
+    names.push_back(symbols.getName(c->name).str());
+    LogInfo("tier-up: %s\n", names.back().c_str());
+  }
+  stats::counters.promotions += batch.size();
+
+  theJIT->lookupAsync(
+      names, [batch](Expected<std::vector<orc::ExecutorAddr>> addrs) {
+        if (!addrs) {
+          // keep interpreting
+          logAllUnhandledErrors(addrs.takeError(), errs(), "tier-up failed: ");
+          return;
+        }
+        for (size_t i = 0; i < batch.size(); i++)
+          if (batch[i]->def->getProto().getArgs().size() <= maxNativeArgs)
+            batch[i]->native.store((*addrs)[i].toPtr<void *>(),
+                                   std::memory_order_release);
+      });
+}
+
+static void heatUp(TierEntry *e) {
+  // >=, so that -tier-threshold=0 compiles on the first call
+  if (e && !e->compiled && ++e->hotness >= tierThreshold)
+    promote(*e);
+}
+
+double callNative(void *fp, ArrayRef<double> a) {
+  using D = double;
+  switch (a.size()) {
+  case 0:
+    return ((D(*)())fp)();
+  case 1:
+    return ((D(*)(D))fp)(a[0]);
+  case 2:
+    return ((D(*)(D, D))fp)(a[0], a[1]);
+  case 3:
+    return ((D(*)(D, D, D))fp)(a[0], a[1], a[2]);
+  case 4:
+    return ((D(*)(D, D, D, D))fp)(a[0], a[1], a[2], a[3]);
+  case 5:
+    return ((D(*)(D, D, D, D, D))fp)(a[0], a[1], a[2], a[3], a[4]);
+  case 6:
+    return ((D(*)(D, D, D, D, D, D))fp)(a[0], a[1], a[2], a[3], a[4], a[5]);
+  default:
+    LogError("too many arguments for a native call from the interpreter");
+    return 0;
+  }
+}
+
+static double callFunction(SymbolID name, ArrayRef<double> args) {
+  TierEntry &e = getEntry(name);
+  if (void *fp = e.native.load(std::memory_order_acquire))
+    return callNative(fp, args);
+
+  if (!e.def) {
+    // an extern: resolve it in the process once
+    PrototypeAST *proto = functionProtos.lookup(name);
+    if (!proto)
+      LogError("unknown function referenced");
+    if (proto->getArgs().size() != args.size())
+      LogError("incorrect # of arguments passed");
+    auto sym = exitOnError(theJIT->lookup(symbols.getName(name)));
+    void *fp = sym.getAddress().toPtr<void *>();
+    e.native.store(fp, std::memory_order_release);
+    return callNative(fp, args);
+  }
+
+  ArrayRef<SymbolID> params = e.def->getProto().getArgs();
+  if (params.size() != args.size())
+    LogError("incorrect # of arguments passed");
+  heatUp(&e);
+  InterpFrame frame(&e);
+  for (size_t i = 0; i < params.size(); i++)
+    frame.bind(params[i], args[i]);
+  return e.def->getBody().eval(frame);
+}
+
+void tierDefine(FunctionAST *def) {
+  const PrototypeAST &proto = def->getProto();
+  TierEntry &e = getEntry(proto.getNameID());
+  if (e.def)
+    LogError("function cannot be redefined");
+  e.def = def;
+  // codegen would do this when the definition is compiled
+  functionProtos[proto.getNameID()] = const_cast<PrototypeAST *>(&proto);
+  installBinaryOperator(proto);
+  analyzePurity(*def);
+}
+
+double tierEvaluate(const FunctionAST &expr) {
+  InterpFrame frame(nullptr);
+  return expr.getBody().eval(frame);
+}
+
+double NumberExprAST::eval(InterpFrame &frame) const { return val; }
+
+double VariableExprAST::eval(InterpFrame &frame) const {
+  double *v = frame.lookup(name);
+  if (!v)
+    LogError("unknown variable name");
+  return *v;
+}
+
+double VarExprAST::eval(InterpFrame &frame) const {
+  size_t scope = frame.pushScope();
+  for (const auto &p : varNames)
+    frame.bind(p.first, p.second ? p.second->eval(frame) : 0.0);
+  double val = body->eval(frame);
+  frame.popScope(scope);
+  return val;
+}
+
+double UnaryExprAST::eval(InterpFrame &frame) const {
+  double v = operand->eval(frame);
+  return callFunction(operatorSymbol(false, op), {v});
+}
+
+double BinaryExprAST::eval(InterpFrame &frame) const {
+  if (op == '=') {
+    auto *var = static_cast<VariableExprAST *>(lhs);
+    double val = rhs->eval(frame);
+    double *slot = frame.lookup(var->getName());
+    if (!slot)
+      LogError("unknown variable name");
+    *slot = val;
+    return val;
+  }
+  double l = lhs->eval(frame);
+  double r = rhs->eval(frame);
+  if (isBuiltinBinOp(op))
+    return evalBuiltinBinOp(op, l, r);
+  return callFunction(operatorSymbol(true, op), {l, r});
+}
+
+double CallExprAST::eval(InterpFrame &frame) const {
+  SmallVector<double, 8> vals;
+  for (ExprAST *arg : args)
+    vals.push_back(arg->eval(frame));
+  return callFunction(callee, vals);
+}
+
+double IfExprAST::eval(InterpFrame &frame) const {
+  return isTrue(cond->eval(frame)) ? then_->eval(frame) : else_->eval(frame);
+}
+
+double ForExprAST::eval(InterpFrame &frame) const {
+  // same order as the generated loop: the end condition is checked after
+  // the body and the increment
+  double startVal = start->eval(frame);
+  size_t scope = frame.pushScope();
+  frame.bind(varName, startVal);
+  do {
+    body->eval(frame);
+    double stepVal = step ? step->eval(frame) : 1.0;
+    *frame.lookup(varName) += stepVal;
+    heatUp(frame.fn);
+  } while (isTrue(end->eval(frame)));
+  frame.popScope(scope);
+  return 0.0;
+}
+
+double ParforExprAST::eval(InterpFrame &frame) const {
+  LogError("parfor is not supported in tier 0, run without -tiered");
+  return 0.0;
+}
+
+// frames only hold doubles
+static double noArrays() {
+  LogError("arrays are not supported in tier 0, run without -tiered");
+  return 0.0;
+}
+
+double IndexExprAST::eval(InterpFrame &frame) const { return noArrays(); }
+
+double ArrayStoreExprAST::eval(InterpFrame &frame) const { return noArrays(); }
+
+double ArrayLenExprAST::eval(InterpFrame &frame) const { return noArrays(); }
+
+double ArrayVarExprAST::eval(InterpFrame &frame) const { return noArrays(); }
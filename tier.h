@@ -0,0 +1,23 @@
+#pragma once
+
+#include "ast.h"
+
+// Tiered execution (-tiered). Definitions are not compiled when they are
+// entered: tier 0 interprets the AST and counts calls and loop iterations per
+// function. Once a function is hot it is compiled at -O, together with every
+// callee that is still interpreted, and calls switch to the machine code as
+// soon as the JIT has it ready (in the background with -jit-threads).
+// Top-level expressions are always interpreted.
+
+bool tieredExecution();
+
+// Make a parsed definition callable; it starts out interpreted.
+void tierDefine(FunctionAST *def);
+
+// Evaluate a top-level expression in tier 0.
+double tierEvaluate(const FunctionAST &expr);
+
+// Interpreters call machine code (JIT'd functions and externs) through a
+// switch on the number of arguments, up to maxNativeArgs.
+const size_t maxNativeArgs = 6;
+double callNative(void *fp, ArrayRef<double> args);
@@ -0,0 +1,164 @@
+#include "bytecode.h"
+#include "common.h"
+#include "stats.h"
+#include "tier.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+class VM {
+  const BytecodeModule &module;
+  // register windows of all active calls; a callee's starts right after its
+  // caller's
+  std::vector<double> stack;
+
+  struct Frame {
+    const BCFunction *fn;
+    const Instr *pc; // the CALL
+    double *regs;
+  };
+  std::vector<Frame> frames;
+
+public:
+  explicit VM(const BytecodeModule &module)
+      : module(module), stack(1 << 20) {}
+
+  double run(unsigned index);
+};
+} // namespace
+
+double VM::run(unsigned index) {
+  const BCFunction *fn = &module.functions[index];
+  double *R = stack.data();
+  double *const stackEnd = stack.data() + stack.size();
+  if (R + fn->numRegs > stackEnd)
+    LogError("bytecode stack overflow");
+  const double *K = fn->consts.data();
+  const Instr *pc = fn->code.data();
+  frames.clear();
+
+  // Threaded dispatch where the compiler supports labels as values: every
+  // handler ends in its own indirect jump, which predicts better than the
+  // single one of a switch.
+#ifdef __GNUC__
+  static const void *const labels[] = {
+#define X(name) &&L_##name,
+      KAL_OPCODES(X)
+#undef X
+  };
+#define VM_CASE(name) L_##name
+#define VM_NEXT() goto *labels[pc->op]
+  VM_NEXT();
+#else
+#define VM_CASE(name) case OP_##name
+#define VM_NEXT() goto dispatch
+dispatch:
+  switch (pc->op) {
+#endif
+
+  VM_CASE(LOADK):
+    R[pc->a] = K[pc->b];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(MOV):
+    R[pc->a] = R[pc->b];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(ADD):
+    R[pc->a] = R[pc->b] + R[pc->c];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(SUB):
+    R[pc->a] = R[pc->b] - R[pc->c];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(MUL):
+    R[pc->a] = R[pc->b] * R[pc->c];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(DIV):
+    R[pc->a] = R[pc->b] / R[pc->c];
+    ++pc;
+    VM_NEXT();
+  VM_CASE(LT):
+    R[pc->a] = evalBuiltinBinOp('<', R[pc->b], R[pc->c]);
+    ++pc;
+    VM_NEXT();
+  VM_CASE(JMP):
+    pc = fn->code.data() + pc->b;
+    VM_NEXT();
+  VM_CASE(JF):
+    pc = isTrue(R[pc->a]) ? pc + 1 : fn->code.data() + pc->b;
+    VM_NEXT();
+  VM_CASE(JT):
+    pc = isTrue(R[pc->a]) ? fn->code.data() + pc->b : pc + 1;
+    VM_NEXT();
+  VM_CASE(CALL): {
+    const BCFunction *callee = &module.functions[pc->b];
+    double *calleeR = R + fn->numRegs;
+    if (calleeR + callee->numRegs > stackEnd)
+      LogError("bytecode stack overflow");
+    std::copy_n(R + pc->c, callee->numParams, calleeR);
+    frames.push_back({fn, pc, R});
+    fn = callee;
+    R = calleeR;
+    K = fn->consts.data();
+    pc = fn->code.data();
+    VM_NEXT();
+  }
+  VM_CASE(CALLX): {
+    const BCExtern &e = module.externs[pc->b];
+    R[pc->a] = callNative(e.addr, ArrayRef<double>(R + pc->c, e.numParams));
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(RET): {
+    double val = R[pc->a];
+    if (frames.empty())
+      return val;
+    const Frame &caller = frames.back();
+    fn = caller.fn;
+    pc = caller.pc;
+    R = caller.regs;
+    frames.pop_back();
+    K = fn->consts.data();
+    R[pc->a] = val;
+    ++pc;
+    VM_NEXT();
+  }
+
+#ifndef __GNUC__
+  default:
+    llvm_unreachable("opcodes are validated when bytecode is loaded");
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+int runBytecode(BytecodeModule &module) {
+  sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  for (BCExtern &e : module.externs) {
+    e.addr = sys::DynamicLibrary::SearchForAddressOfSymbol(e.name);
+    if (!e.addr) {
+      errs() << "unresolved extern " << e.name << "\n";
+      return 1;
+    }
+  }
+
+  VM vm(module);
+  for (uint32_t index : module.topLevel) {
+    double val;
+    {
+      PhaseTimer timer(Phase::exec);
+      val = vm.run(index);
+    }
+    stats::counters.exprs++;
+    fprintf(stderr, "Evaluated to %f\n", val);
+  }
+  return 0;
+}